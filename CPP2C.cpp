@@ -1,22 +1,54 @@
+#include "CPP2C.h"
+
 #include <clang/AST/AST.h>
 #include <clang/AST/ASTConsumer.h>
 #include <clang/AST/ASTContext.h>
+#include <clang/Basic/DiagnosticSema.h>
+#include <clang/AST/QualTypeNames.h>
+#include <clang/AST/RecordLayout.h>
 #include <clang/AST/RecursiveASTVisitor.h>
 #include <clang/ASTMatchers/ASTMatchFinder.h>
 #include <clang/ASTMatchers/ASTMatchers.h>
 #include <clang/Driver/Options.h>
 #include <clang/Frontend/ASTConsumers.h>
+#include <clang/Frontend/ASTUnit.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/FrontendActions.h>
+#include <clang/Frontend/Utils.h>
 #include <clang/Rewrite/Core/Rewriter.h>
+#include <clang/Sema/Sema.h>
+#include <clang/Sema/SemaConsumer.h>
+#include <clang/Serialization/ASTReader.h>
 #include <clang/Tooling/CommonOptionsParser.h>
 #include <clang/Tooling/Tooling.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/ADT/StringSwitch.h>
+#include <llvm/Support/FileUtilities.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Regex.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/VirtualFileSystem.h>
 #include <map>
+#include <poll.h>
 #include <set>
 #include <sstream>
+#include <sys/inotify.h>
 #include <tuple>
+#include <unistd.h>
 #include <vector>
 
 using namespace std;
@@ -38,26 +70,390 @@ static cl::opt<std::string> ClassesToGenrate(
              "ConditionVariable Semaphore uThreadPool"),
     cl::cat(CPP2CCategory));
 
+static cl::opt<unsigned> Jobs(
+    "j",
+    cl::desc("Number of translation units to parse in parallel, 0 uses "
+             "every core"),
+    cl::init(1), cl::cat(CPP2CCategory));
+
+static cl::opt<std::string> CacheDir(
+    "cache-dir",
+    cl::desc("Directory of the incremental regeneration cache, sources whose "
+             "includes, flags and options did not change are not reparsed"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<std::string> SystemPCH(
+    "system-pch",
+    cl::desc("Precompile the system headers included by the sources into "
+             "this file and reuse it on later runs while it is up to date"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<bool> EmitCMake(
+    "emit-cmake",
+    cl::desc("Also write cwrapper.cmake, a CMake target building the wrappers "
+             "for cross-language ThinLTO so C callers inline through them"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<bool> Placement(
+    "placement",
+    cl::desc("Also emit <Class>_sizeof/_alignof and <Class>_init/_fini, to "
+             "construct objects in storage provided by the C caller"),
+    cl::cat(CPP2CCategory));
+
+static cl::list<std::string> Pooled(
+    "pooled",
+    cl::desc("Classes whose _create/_destroy use a per-class, thread-cached "
+             "slab pool instead of the global allocator"),
+    cl::CommaSeparated, cl::cat(CPP2CCategory));
+
+static cl::opt<bool> AccurateSignatures(
+    "accurate-signatures",
+    cl::desc("Take a const self in const methods, no self in static methods, "
+             "and mark prototypes pure/const/nothrow/nonnull/returns_nonnull "
+             "where the AST proves it"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<std::string> BatchPattern(
+    "batch",
+    cl::desc("Regular expression over Class::method, matching methods also "
+             "get a <Class>_<method>_batch wrapper calling them on an array "
+             "of objects"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<std::string> AsyncPattern(
+    "async",
+    cl::desc("Regular expression over Class::method, matching methods, and "
+             "methods annotated \"cpp2c_async\", also get a "
+             "<Class>_<method>_submit wrapper running them on worker threads"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<bool> ExceptionBoundary(
+    "exception-boundary",
+    cl::desc("Catch the exceptions of methods that are not noexcept in their "
+             "wrapper, and report them through cpp2c_last_error()"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<std::string> Instantiate(
+    "instantiate",
+    cl::desc("Class template specializations to instantiate and wrap, split "
+             "by comma, e.g. 'RingBuffer<int>,RingBuffer<Packet*>' gets "
+             "RingBuffer_int_* and RingBuffer_Packet_p_* wrappers"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<bool> ShardByClass(
+    "shard-by-class",
+    cl::desc("Write the wrappers of each class to cwrapper_<Class>.cpp, "
+             "cwrapper.cpp keeps the definitions they share"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<unsigned> ShardSize(
+    "shard-size",
+    cl::desc("Write the wrappers to files of about this many bytes, "
+             "cwrapper_<n>.cpp, or cwrapper_<Class>_<n>.cpp with "
+             "-shard-by-class"),
+    cl::init(0), cl::cat(CPP2CCategory));
+
+static cl::opt<unsigned> UnityShards(
+    "unity",
+    cl::desc("Group the shards by this many into cwrapper_unity_<n>.cpp, "
+             "which are the files to compile"),
+    cl::init(0), cl::cat(CPP2CCategory));
+
+static cl::opt<std::string> HeaderFilter(
+    "header-filter",
+    cl::desc("Regular expression over header paths, only the classes of the "
+             "main file and of the matching headers are wrapped (system "
+             "headers are never searched)"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<bool> InlineAccessors(
+    "inline-accessors",
+    cl::desc("Define the wrappers of methods returning a field of their class "
+             "as static inline loads in cwrapper.h"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<bool> Instrument(
+    "instrument",
+    cl::desc("Count the calls and latencies of every wrapper per thread when "
+             "cwrapper.cpp is compiled with CPP2C_STATS, reported by "
+             "cpp2c_stats_dump()"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<std::string> OverheadBench(
+    "overhead-bench",
+    cl::desc("Regular expression over Class::method, also write "
+             "cwrapper_bench.cpp timing the wrappers of the matching methods "
+             "against direct C++ calls"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<double> OverheadThreshold(
+    "overhead-threshold",
+    cl::desc("Default ns/call of overhead above which cwrapper_bench flags "
+             "a wrapper"),
+    cl::init(1.0), cl::cat(CPP2CCategory));
+
+static cl::opt<std::string> LayoutReport(
+    "layout-report",
+    cl::desc("Write the layout of every wrapped class, its padding, cache "
+             "lines and the atomics and locks sharing a line, to this JSON "
+             "file"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<unsigned> CacheLineSize(
+    "cache-line",
+    cl::desc("Cache line size in bytes of -layout-report and -align-create"),
+    cl::init(64), cl::cat(CPP2CCategory));
+
+static cl::opt<bool> AlignCreate(
+    "align-create",
+    cl::desc("Allocate the objects of _create on their own cache lines"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<std::string> EmitIR(
+    "emit-ir",
+    cl::desc("Write the extracted API model to this JSON file, for -from-ir"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<std::string> FromIR(
+    "from-ir",
+    cl::desc("Emit the wrappers from a file of -emit-ir instead of parsing "
+             "sources"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<bool> PrintTiming(
+    "print-timing",
+    cl::desc("Print how long each source took to parse and match"),
+    cl::cat(CPP2CCategory));
+
+static cl::opt<bool> Watch(
+    "watch",
+    cl::desc("Keep the sources parsed and regenerate the wrappers whenever "
+             "one of the files they include changes"),
+    cl::cat(CPP2CCategory));
+
 /** Classes to be mapped to C **/
-struct OutputStreams {
-  string headerString;
-  string bodyString;
+llvm::SmallVector<llvm::StringRef, 16> ClassList;
+llvm::StringSet<> ClassSet; // ClassList, hashed for lookups
 
-  llvm::raw_string_ostream HeaderOS;
-  llvm::raw_string_ostream BodyOS;
+// -batch, -async and -overhead-bench, anchored on both ends
+std::unique_ptr<llvm::Regex> BatchRegex;
+std::unique_ptr<llvm::Regex> AsyncRegex;
+std::unique_ptr<llvm::Regex> OverheadRegex;
+std::unique_ptr<llvm::Regex> HeaderRegex;
 
-  OutputStreams() : HeaderOS(headerString), BodyOS(bodyString){};
+void addWrappedClass(StringRef className) {
+  if (ClassSet.insert(className).second)
+    ClassList.push_back(className);
+}
+
+bool isWrappedClass(StringRef className) {
+  return ClassSet.count(className);
+}
+
+/** A class template specialization listed in -instantiate **/
+struct Instantiation {
+  string spelling;     // "RingBuffer<Packet*>"
+  string templateName; // "RingBuffer"
+  vector<string> args; // "Packet*"
+  string cName;        // "RingBuffer_Packet_p"
 };
 
-llvm::SmallVector<llvm::StringRef, 16> ClassList;
-map<string, int> funcList;
+vector<Instantiation> Instantiations;
+
+// spelling as a C identifier, "RingBuffer<Packet*>" is "RingBuffer_Packet_p"
+string cIdentifier(StringRef spelling) {
+  string id;
+  bool separate = false;
+  for (char c : spelling) {
+    if (llvm::isAlnum(c) || c == '_' || c == '*') {
+      if ((separate || c == '*') && !id.empty())
+        id += '_';
+      id += c == '*' ? 'p' : c;
+      separate = c == '*';
+    } else {
+      separate = true;
+    }
+  }
+  return id;
+}
+
+// splits s at the commas that are not nested in <> or ()
+vector<string> splitTopLevel(StringRef s) {
+  vector<string> parts;
+  int depth = 0;
+  size_t start = 0;
+  for (size_t i = 0; i <= s.size(); i++) {
+    if (i == s.size() || (s[i] == ',' && depth == 0)) {
+      parts.push_back(s.slice(start, i).trim().str());
+      start = i + 1;
+    } else if (s[i] == '<' || s[i] == '(') {
+      depth++;
+    } else if (s[i] == '>' || s[i] == ')') {
+      depth--;
+    }
+  }
+  return parts;
+}
+
+// the lower-case words of an identifier, split at underscores and case
+// changes: "RWSpinLock" is "rw", "spin", "lock"
+vector<string> identifierWords(StringRef name) {
+  auto isUpper = [](char c) { return c >= 'A' && c <= 'Z'; };
+  auto isLower = [](char c) { return c >= 'a' && c <= 'z'; };
+  vector<string> words;
+  string word;
+  for (size_t i = 0; i < name.size(); i++) {
+    char c = name[i];
+    bool startsWord =
+        isUpper(c) && i > 0 &&
+        (isLower(name[i - 1]) || llvm::isDigit(name[i - 1]) ||
+         (i + 1 < name.size() && isLower(name[i + 1])));
+    if (c == '_' || startsWord) {
+      if (!word.empty())
+        words.push_back(word);
+      word.clear();
+    }
+    if (c != '_')
+      word += llvm::toLower(c);
+  }
+  if (!word.empty())
+    words.push_back(word);
+  return words;
+}
+
+bool isPooled(StringRef className) {
+  return std::find(Pooled.begin(), Pooled.end(), className) != Pooled.end();
+}
+
+/** The extracted model as JSON, for the cache and -emit-ir **/
+llvm::json::Value toJSON(const WrapperParam &param) {
+  return llvm::json::Object{{"name", param.name},
+                            {"cType", param.cType},
+                            {"cxxType", param.cxxType},
+                            {"conversion", param.conversion}};
+}
+
+bool fromJSON(const llvm::json::Value &v, WrapperParam &param,
+              llvm::json::Path p) {
+  llvm::json::ObjectMapper O(v, p);
+  return O && O.map("name", param.name) && O.map("cType", param.cType) &&
+         O.map("cxxType", param.cxxType) &&
+         O.map("conversion", param.conversion);
+}
+
+llvm::json::Value toJSON(const WrapperFunction &wf) {
+  return llvm::json::Object{{"location", wf.location},
+                            {"className", wf.className},
+                            {"methodName", wf.methodName},
+                            {"cxxMethod", wf.cxxMethod},
+                            {"cxxSignature", wf.cxxSignature},
+                            {"isStatic", wf.isStatic},
+                            {"isConst", wf.isConst},
+                            {"returnType", wf.returnType},
+                            {"cxxReturnType", wf.cxxReturnType},
+                            {"returnConversion", wf.returnConversion},
+                            {"params", wf.params},
+                            {"attributes", wf.attributes},
+                            {"body", wf.body},
+                            {"benchObject", wf.benchObject},
+                            {"benchDirect", wf.benchDirect},
+                            {"benchArgs", wf.benchArgs},
+                            {"fieldOffset", wf.fieldOffset},
+                            {"fieldCheck", wf.fieldCheck},
+                            {"async", wf.async}};
+}
+
+bool fromJSON(const llvm::json::Value &v, WrapperFunction &wf,
+              llvm::json::Path p) {
+  llvm::json::ObjectMapper O(v, p);
+  return O && O.map("location", wf.location) &&
+         O.map("className", wf.className) &&
+         O.map("methodName", wf.methodName) &&
+         O.map("cxxMethod", wf.cxxMethod) &&
+         O.map("cxxSignature", wf.cxxSignature) &&
+         O.map("isStatic", wf.isStatic) && O.map("isConst", wf.isConst) &&
+         O.map("returnType", wf.returnType) &&
+         O.map("cxxReturnType", wf.cxxReturnType) &&
+         O.map("returnConversion", wf.returnConversion) &&
+         O.map("params", wf.params) &&
+         O.map("attributes", wf.attributes) && O.map("body", wf.body) &&
+         O.map("benchObject", wf.benchObject) &&
+         O.map("benchDirect", wf.benchDirect) &&
+         O.map("benchArgs", wf.benchArgs) &&
+         O.map("fieldOffset", wf.fieldOffset) &&
+         O.map("fieldCheck", wf.fieldCheck) && O.map("async", wf.async);
+}
+
+llvm::json::Value toJSON(const LayoutMember &lm) {
+  return llvm::json::Object{{"name", lm.name},
+                            {"type", lm.type},
+                            {"offset", lm.offset},
+                            {"size", lm.size},
+                            {"kind", lm.kind}};
+}
+
+bool fromJSON(const llvm::json::Value &v, LayoutMember &lm,
+              llvm::json::Path p) {
+  llvm::json::ObjectMapper O(v, p);
+  return O && O.map("name", lm.name) && O.map("type", lm.type) &&
+         O.map("offset", lm.offset) && O.map("size", lm.size) &&
+         O.map("kind", lm.kind);
+}
+
+llvm::json::Value toJSON(const WrapperClass &wc) {
+  return llvm::json::Object{{"name", wc.name},
+                            {"cxxName", wc.cxxName},
+                            {"size", wc.size},
+                            {"align", wc.align},
+                            {"byValue", wc.byValue},
+                            {"members", wc.members}};
+}
+
+bool fromJSON(const llvm::json::Value &v, WrapperClass &wc,
+              llvm::json::Path p) {
+  llvm::json::ObjectMapper O(v, p);
+  return O && O.map("name", wc.name) && O.map("cxxName", wc.cxxName) &&
+         O.map("size", wc.size) && O.map("align", wc.align) &&
+         O.map("byValue", wc.byValue) && O.map("members", wc.members);
+}
+
+llvm::json::Value toJSON(const MirroredRecord &mr) {
+  return llvm::json::Object{{"name", mr.name},
+                            {"definition", mr.definition},
+                            {"checks", mr.checks}};
+}
+
+bool fromJSON(const llvm::json::Value &v, MirroredRecord &mr,
+              llvm::json::Path p) {
+  llvm::json::ObjectMapper O(v, p);
+  return O && O.map("name", mr.name) && O.map("definition", mr.definition) &&
+         O.map("checks", mr.checks);
+}
+
+// what the handlers extracted, for the cache and -emit-ir
+llvm::json::Value toJSON(const TUResult &result) {
+  return llvm::json::Object{{"functions", result.functions},
+                            {"classes", result.classes},
+                            {"records", result.records},
+                            {"bodyIncludes", result.bodyIncludes},
+                            {"callbackTypedefs", result.callbackTypedefs}};
+}
+
+bool fromJSON(const llvm::json::Value &v, TUResult &result,
+              llvm::json::Path p) {
+  llvm::json::ObjectMapper O(v, p);
+  return O && O.map("functions", result.functions) &&
+         O.map("classes", result.classes) && O.map("records", result.records) &&
+         O.map("bodyIncludes", result.bodyIncludes) &&
+         O.map("callbackTypedefs", result.callbackTypedefs);
+}
 
 /** Matchers **/
 
 /** Handlers **/
 class classMatchHandler : public MatchFinder::MatchCallback {
 public:
-  classMatchHandler(OutputStreams &os) : OS(os) {}
+  classMatchHandler(TUResult &result) : TU(result) {}
 
   tuple<string, string, bool, bool> determineCType(const QualType &qt) {
 
@@ -75,21 +471,28 @@ public:
       // if it is a CXXrecordDecl then return a pointer to WName*
     } else if (qt->isRecordType()) {
       const CXXRecordDecl *crd = qt->getAsCXXRecordDecl();
-      string recordName = crd->getNameAsString();
-      CType = "W" + recordName + "*";
-      CastType = recordName + "*";
-
+      // passed by value as its C mirror
+      if (mirrorRecord(crd)) {
+        CType = "W" + cRecordName(crd);
+        CastType = qualifiedName(crd);
+      } else if (isWrappedClass(cClassName(crd))) {
+        CType = "W" + cClassName(crd) + "*";
+        CastType = cxxClassName(crd) + "*";
+      } else {
+        // a handle of its own, declared in the header from its layout
+        CType = "W" + cRecordName(crd) + "*";
+        CastType = qualifiedName(crd) + "*";
+        recordLayout(*Context, crd, cRecordName(crd));
+      }
     } else if ((qt->isReferenceType() || qt->isPointerType()) &&
                qt->getPointeeType()->isRecordType()) {
       isPointer = true; // to properly differentiate among cast types
       const CXXRecordDecl *crd = qt->getPointeeType()->getAsCXXRecordDecl();
-      string recordName = crd->getNameAsString();
-      if (std::find(ClassList.begin(), ClassList.end(), recordName) !=
-          ClassList.end()) {
-        CType = "W" + recordName + "*";
-        CastType = recordName + "*";
+      if (isWrappedClass(cClassName(crd))) {
+        CType = "W" + cClassName(crd) + "*";
+        CastType = cxxClassName(crd) + "*";
       } else {
-        CType = recordName + "*";
+        CType = crd->getNameAsString() + "*";
       }
     }
     return make_tuple(CType, CastType, isPointer, shoulReturn);
@@ -98,228 +501,4026 @@ public:
   virtual void run(const MatchFinder::MatchResult &Result) {
     if (const CXXMethodDecl *cmd =
             Result.Nodes.getNodeAs<CXXMethodDecl>("publicMethodDecl")) {
+      Context = Result.Context;
+      const CXXRecordDecl *parent = cmd->getParent();
+      // other specializations of an -instantiate template
+      if (isa<ClassTemplateSpecializationDecl>(parent) &&
+          !Instantiated.count(parent->getCanonicalDecl()) &&
+          !isWrappedClass(parent->getNameAsString()))
+        return;
+
       string methodName;
-      string className = cmd->getParent()->getDeclName().getAsString();
+      string className = cClassName(parent);
+      string cxxClass = cxxClassName(parent); // className, or RingBuffer<int>
       string returnType;
       string returnCast;
+      string cxxReturnType, returnConversion = "none";
       bool shouldReturn, isPointer;
-      string self = "W" + className + "* self";
+      string self = "W" + className + "*"; // type of self, if any
+      string selfCast = cxxClass + "*";
       string separator = ", ";
+      vector<unsigned> nonnull; // 1-based positions of never-null parameters
       string bodyEnd;
+      string bodyTail; // statements after the call
+      string exactHead; // the body up to the non-virtual call, if any
+      bool resultStorage = false;
+      bool lowered = false; // a container or callback became several params
+      vector<WrapperParam> outParams;
+      WrapperFunction wf;
 
       std::stringstream functionBody;
+      std::stringstream callArgs;
 
       // ignore operator overloadings
       if (cmd->isOverloadedOperator())
         return;
 
+      recordLayout(*Result.Context, parent, className);
+
+      if (AccurateSignatures && !isa<CXXConstructorDecl>(cmd) &&
+          !isa<CXXDestructorDecl>(cmd)) {
+        if (cmd->isStatic())
+          self = "";
+        else if (cmd->isConst()) {
+          self = "const " + self;
+          selfCast = "const " + selfCast;
+        }
+        // self is dereferenced
+        if (!cmd->isStatic())
+          nonnull.push_back(1);
+      }
+
       // constructor
       if (const CXXConstructorDecl *ccd = dyn_cast<CXXConstructorDecl>(cmd)) {
         if (ccd->isCopyConstructor() || ccd->isMoveConstructor())
           return;
         methodName = "_create";
         returnType = "W" + className + "*";
+        cxxReturnType = cxxClass + " *";
+        returnConversion = "handle";
         self = "";
-        separator = "";
-        functionBody << "return reinterpret_cast<" << returnType << ">( new "
-                     << className << "(";
+        if (isPooled(className))
+          functionBody << "return reinterpret_cast<" << returnType
+                       << ">( cpp2c::SlabPool<" << cxxClass
+                       << ">::instance().create(";
+        else if (AlignCreate)
+          functionBody << "return reinterpret_cast<" << returnType
+                       << ">( cpp2c::createAligned<" << cxxClass << ">(";
+        else
+          functionBody << "return reinterpret_cast<" << returnType
+                       << ">( new " << cxxClass << "(";
         bodyEnd += "))";
       } else if (isa<CXXDestructorDecl>(cmd)) {
         methodName = "_destroy";
         returnType = "void";
-        functionBody << " delete reinterpret_cast<" << className << "*>(self)";
+        cxxReturnType = "void";
+        if (isPooled(className))
+          functionBody << " cpp2c::SlabPool<" << cxxClass
+                       << ">::instance().destroy(reinterpret_cast<"
+                       << cxxClass << "*>(self))";
+        else if (AlignCreate)
+          functionBody << " cpp2c::destroyAligned(reinterpret_cast<"
+                       << cxxClass << "*>(self))";
+        else
+          functionBody << " delete reinterpret_cast<" << cxxClass
+                       << "*>(self)";
       } else {
         methodName = "_" + cmd->getNameAsString();
         const QualType qt = cmd->getReturnType();
         std::tie(returnType, returnCast, isPointer, shouldReturn) =
             determineCType(qt);
+        cxxReturnType = qt.getAsString(Result.Context->getPrintingPolicy());
+        const CXXRecordDecl *byValue =
+            qt->isRecordType() ? qt->getAsCXXRecordDecl() : nullptr;
+        ContainerLowering container;
 
         // should this function return?
+        if (lowerContainer(qt, true, container)) {
+          byValue = nullptr;
+          shouldReturn = false;
+        }
         if (shouldReturn)
           functionBody << "return ";
 
-        if (returnCast != "") {
-          // if not pointer and it needs to be casted, then return the pointer
-          if (!isPointer)
-            functionBody << "&";
+        if (container.kind != ContainerLowering::None) {
+          // views of storage owned by the C++ side are returned as they
+          // are, containers are copied to a buffer of the caller, which gets
+          // the full size back to retry with a larger one
+          lowered = true;
+          functionBody << "auto &&value = ";
+          if (container.view) {
+            returnType = container.cElement + "*";
+            returnConversion = "view";
+            outParams.push_back(
+                {"result_len", "size_t*", cxxReturnType, "out-length"});
+            bodyTail = ";\n    *result_len = value.size();\n"
+                       "    return reinterpret_cast<" +
+                       returnType + ">(value.data())";
+          } else {
+            returnType = "size_t";
+            returnConversion = "buffer";
+            outParams.push_back({"result", container.cBufferElement + "*",
+                                 cxxReturnType, "out-buffer"});
+            outParams.push_back(
+                {"result_capacity", "size_t", cxxReturnType, "out-capacity"});
+            bodyTail = ";\n    size_t count = value.size() < result_capacity "
+                       "? value.size() : result_capacity;\n"
+                       "    if (count)\n"
+                       "        std::memcpy(result, value.data(), count * "
+                       "sizeof(*result));\n"
+                       "    return value.size()";
+            addBodyInclude("<cstring>");
+          }
+        } else if (byValue && mirrorRecord(byValue)) {
+          returnConversion = "mirror";
+          functionBody << "cpp2c::mirror<" << returnType << ">(";
+          bodyEnd += ")";
+        } else if (byValue) {
+          // other records are moved into <Record>_sizeof bytes of storage
+          // provided by the caller
+          resultStorage = true;
+          returnConversion = "result-storage";
+          recordLayout(*Result.Context, byValue, cRecordName(byValue), true);
+          functionBody << "reinterpret_cast<" << returnType
+                       << ">( new (result) " << qualifiedName(byValue) << "(";
+          bodyEnd += "))";
+        } else if (returnCast != "") {
           functionBody << "reinterpret_cast<" << returnType << ">(";
+          returnConversion = "handle";
+          // references are returned as pointers
+          if (qt->isReferenceType()) {
+            functionBody << "&";
+            returnConversion = "address";
+          }
           bodyEnd += ")";
         }
 
         // if Static call it properly
         if (cmd->isStatic())
-          functionBody << className << "::" << cmd->getNameAsString() << "(";
+          functionBody << cxxClass << "::" << cmd->getNameAsString() << "(";
         // if not  use the passed object to call the method
-        else
-          functionBody << "reinterpret_cast<" << className << "*>(self)->"
-                       << cmd->getNameAsString() << "(";
+        else {
+          functionBody << "reinterpret_cast<" << selfCast << ">(self)->";
+          // A final method, or a method of a final class, has no overrider:
+          // call it without the vtable so that it can be inlined. Other
+          // virtual methods get a <Class>_<method>_exact variant calling
+          // the method of Class itself, for handles made by Class_create.
+          if (cmd->isVirtual() && !cmd->isPure() &&
+              (cmd->hasAttr<FinalAttr>() || parent->isEffectivelyFinal()))
+            functionBody << cxxClass << "::";
+          else if (cmd->isVirtual() && !cmd->isPure() && !parent->isAbstract())
+            exactHead = functionBody.str() + cxxClass + "::" +
+                        cmd->getNameAsString() + "(";
+          functionBody << cmd->getNameAsString() << "(";
+        }
 
         bodyEnd += ")";
       }
 
-      std::stringstream funcname;
-      funcname << returnType << " " << className << methodName;
-
-      auto it = funcList.find(funcname.str());
-
-      if (it != funcList.end()) {
-        it->second++;
-        funcname << "_" << it->second;
-      } else {
-        funcList[funcname.str()] = 0;
-      }
-
-      funcname << "(" << self;
+      if (self != "")
+        wf.params.push_back({"self", self, selfCast, "self"});
+      if (resultStorage)
+        wf.params.push_back(
+            {"result", "void*", cxxReturnType, "result-storage"});
+      wf.params.insert(wf.params.end(), outParams.begin(), outParams.end());
 
       for (unsigned int i = 0; i < cmd->getNumParams(); i++) {
         const QualType qt = cmd->parameters()[i]->getType();
-        std::tie(returnType, returnCast, isPointer, shouldReturn) =
+        string paramName = cmd->parameters()[i]->getQualifiedNameAsString();
+        string cxxType = qt.getAsString(Result.Context->getPrintingPolicy());
+        ContainerLowering container;
+        if (lowerContainer(qt, false, container)) {
+          // views are built on the caller's elements, containers copy them
+          lowered = true;
+          string pointer = "reinterpret_cast<" + container.cxxPointer + ">(" +
+                           paramName + ")";
+          wf.params.push_back(
+              {paramName, container.cElement + "*", cxxType, "data"});
+          wf.params.push_back(
+              {paramName + "_len", "size_t", cxxType, "length"});
+          if (i != 0)
+            callArgs << separator;
+          callArgs << container.cxxType << "(" << pointer << ", ";
+          if (container.kind == ContainerLowering::Vector)
+            callArgs << pointer << " + ";
+          callArgs << paramName << "_len)";
+          continue;
+        }
+
+        CallbackLowering callback;
+        if (lowerCallback(qt, callback)) {
+          // the lambda only captures the function pointer and its context,
+          // which std::function stores inline instead of allocating
+          lowered = true;
+          wf.params.push_back(
+              {paramName, callback.typedefName, cxxType, "callback"});
+          wf.params.push_back(
+              {paramName + "_ctx", "void*", cxxType, "context"});
+          if (i != 0)
+            callArgs << separator;
+          callArgs << "(" << paramName << " ? " << callback.cxxType << "(["
+                   << paramName << ", " << paramName << "_ctx]("
+                   << callback.lambdaParams << ") { return "
+                   << callback.resultPrefix << paramName << "(" << paramName
+                   << "_ctx" << callback.callArgs << ")"
+                   << callback.resultSuffix << "; }) : " << callback.cxxType
+                   << "())";
+          addBodyInclude("<functional>");
+          continue;
+        }
+
+        string paramType;
+        std::tie(paramType, returnCast, isPointer, std::ignore) =
             determineCType(qt);
-        funcname << separator << returnType << " ";
-        funcname << cmd->parameters()[i]->getQualifiedNameAsString() << "";
+        string conversion;
+        if (returnCast == "")
+          conversion = "none";
+        else if (qt->isRecordType() && mirrorRecord(qt->getAsCXXRecordDecl()))
+          conversion = "mirror";
+        else
+          conversion = qt->isPointerType() ? "handle" : "handle-deref";
+        wf.params.push_back({paramName, paramType, cxxType, conversion});
+        // a reference passed as a pointer
+        if (isPointer && qt->isReferenceType())
+          nonnull.push_back(wf.params.size());
 
         if (i != 0)
-          functionBody << separator;
+          callArgs << separator;
         if (returnCast == "")
-          functionBody << cmd->parameters()[i]->getQualifiedNameAsString();
+          callArgs << cmd->parameters()[i]->getQualifiedNameAsString();
+        else if (qt->isRecordType() && mirrorRecord(qt->getAsCXXRecordDecl()))
+          callArgs << "*reinterpret_cast<const " << returnCast << "*>(&"
+                   << cmd->parameters()[i]->getQualifiedNameAsString() << ")";
         else {
           if (!isPointer)
-            functionBody << "*";
-          functionBody << "reinterpret_cast<" << returnCast << ">("
-                       << cmd->parameters()[i]->getQualifiedNameAsString()
-                       << ")";
+            callArgs << "*";
+          callArgs << "reinterpret_cast<" << returnCast << ">("
+                   << cmd->parameters()[i]->getQualifiedNameAsString() << ")";
+        }
+      }
+
+      wf.location = declLocation(*Result.SourceManager, cmd);
+      wf.className = className;
+      wf.methodName = methodName;
+      wf.cxxMethod = cxxClass + "::" + cmd->getNameAsString();
+      wf.cxxSignature =
+          cmd->getType().getAsString(Result.Context->getPrintingPolicy());
+      wf.isStatic = cmd->isStatic();
+      wf.isConst = cmd->isConst();
+      wf.returnType = returnType;
+      wf.cxxReturnType = cxxReturnType;
+      wf.returnConversion = returnConversion;
+      wf.body = functionBody.str() + callArgs.str() + bodyEnd + bodyTail;
+      if (AccurateSignatures)
+        wf.attributes = provenAttributes(*Result.Context, cmd, nonnull, false);
+      // the wrapper writes through its out parameters or into the result
+      // storage, and the data of an empty container may be null
+      if (lowered || resultStorage)
+        eraseAttributes(wf, {"pure", "const", "returns_nonnull"});
+
+      bool methodMayThrow = !isNothrow(cmd);
+
+      // static methods have no object to batch over, whether or not their
+      // wrapper takes a self
+      if (BatchRegex && !cmd->isStatic() && !resultStorage && !lowered &&
+          !isa<CXXConstructorDecl>(cmd) && !isa<CXXDestructorDecl>(cmd) &&
+          BatchRegex->match(className + "::" + cmd->getNameAsString())) {
+        WrapperFunction batch = batchFunction(wf, shouldReturn);
+        guardExceptions(batch, methodMayThrow);
+        TU.functions.push_back(std::move(batch));
+      }
+
+      if (!resultStorage && !lowered && !isa<CXXConstructorDecl>(cmd) &&
+          !isa<CXXDestructorDecl>(cmd) && isAsync(cmd, className)) {
+        TU.functions.push_back(asyncFunction(wf, shouldReturn));
+      }
+
+      // construction in caller-provided storage, next to _create/_destroy
+      if (Placement && isa<CXXConstructorDecl>(cmd)) {
+        WrapperFunction init = wf;
+        init.methodName = "_init";
+        init.params.insert(init.params.begin(),
+                           WrapperParam{"storage", "void*", "", "storage"});
+        init.body = "return reinterpret_cast<" + returnType +
+                    ">( new (storage) " + cxxClass + "(" + callArgs.str() +
+                    "))";
+        if (AccurateSignatures) {
+          vector<unsigned> initNonnull(1, 1);
+          for (unsigned position : nonnull)
+            initNonnull.push_back(position + 1);
+          init.attributes =
+              provenAttributes(*Result.Context, cmd, initNonnull, true);
         }
+        guardExceptions(init, methodMayThrow);
+        TU.functions.push_back(std::move(init));
+      } else if (Placement && isa<CXXDestructorDecl>(cmd)) {
+        WrapperFunction fini = wf;
+        fini.methodName = "_fini";
+        fini.body = "reinterpret_cast<" + cxxClass + "*>(self)->~" +
+                    parent->getNameAsString() + "()";
+        guardExceptions(fini, methodMayThrow);
+        TU.functions.push_back(std::move(fini));
+      }
+      if (OverheadRegex && !resultStorage && !lowered &&
+          !isa<CXXConstructorDecl>(cmd) && !isa<CXXDestructorDecl>(cmd) &&
+          OverheadRegex->match(className + "::" + cmd->getNameAsString()))
+        benchCall(wf, cmd, self != "", cxxClass);
 
-        string separator = ", ";
+      WrapperFunction exact;
+      if (!exactHead.empty()) {
+        exact = wf;
+        exact.methodName += "_exact";
+        exact.body = exactHead + callArgs.str() + bodyEnd + bodyTail;
+        guardExceptions(exact, methodMayThrow);
       }
-      funcname << ")";
 
-      OS.HeaderOS << funcname.str() << ";\n";
+      // new can throw bad_alloc whatever the constructor
+      bool mayThrow = methodMayThrow || isa<CXXConstructorDecl>(cmd);
+      WrapperFunction checked;
+      if (ExceptionBoundary && mayThrow)
+        checked = errorFunction(wf);
+
+      // not copied to the variants above, which stay out of line
+      if (!lowered)
+        returnedField(wf, cmd, cxxClass);
 
-      OS.BodyOS << funcname.str() << "{\n    ";
-      OS.BodyOS << functionBody.str();
-      OS.BodyOS << bodyEnd << "; \n}\n";
+      guardExceptions(wf, mayThrow);
+      TU.functions.push_back(std::move(wf));
+      if (!exactHead.empty())
+        TU.functions.push_back(std::move(exact));
+      if (!checked.methodName.empty())
+        TU.functions.push_back(std::move(checked));
     }
   }
   virtual void onEndOfTranslationUnit() {}
 
 private:
-  OutputStreams &OS;
-};
+  // With -exception-boundary no exception leaves a wrapper: the body of a
+  // wrapper that may throw is put in a try block, and a caught exception is
+  // recorded for cpp2c_last_error() before returning a zero value. Wrappers of
+  // noexcept methods keep their direct body, which costs nothing, and in both
+  // cases the prototype is nothrow.
+  static void guardExceptions(WrapperFunction &wf, bool mayThrow) {
+    if (!ExceptionBoundary)
+      return;
+    if (std::find(wf.attributes.begin(), wf.attributes.end(), "nothrow") ==
+        wf.attributes.end())
+      wf.attributes.push_back("nothrow");
+    if (!mayThrow)
+      return;
+    // null when the exception is caught
+    eraseAttributes(wf, {"returns_nonnull"});
 
-/****************** /Member Functions *******************************/
-// Implementation of the ASTConsumer interface for reading an AST produced
-// by the Clang parser. It registers a couple of matchers and runs them on
-// the AST.
-class MyASTConsumer : public ASTConsumer {
-public:
-  MyASTConsumer(OutputStreams &os) : OS(os), HandlerForClassMatcher(os) {
-    // Add a simple matcher for finding 'if' statements.
+    std::stringstream body;
+    body << "try {\n        " << wf.body
+         << ";\n    } catch (...) {\n        cpp2c::setLastError();\n    }";
+    if (wf.returnType != "void")
+      body << "\n    return {}";
+    wf.body = body.str();
+  }
+
+  // <wrapper>_err, the wrapper of a method that may throw with a trailing
+  // cpp2c_error* set on every call: CPP2C_OK, or the error also recorded for
+  // cpp2c_last_error(). The caller checks it without clearing the last error
+  // before each call.
+  static WrapperFunction errorFunction(const WrapperFunction &wf) {
+    WrapperFunction checked = wf;
+    checked.methodName += "_err";
+    checked.params.push_back({"error", "cpp2c_error*", "", "error"});
+    checked.benchObject = checked.benchDirect = checked.benchArgs = "";
+    // it writes through error, and returns a zero value when it catches
+    eraseAttributes(checked, {"pure", "const", "returns_nonnull"});
+    if (!llvm::is_contained(checked.attributes, "nothrow"))
+      checked.attributes.push_back("nothrow");
+
+    // error may be NULL, the last error is then the only report
+    std::stringstream body;
+    body << "if (error)\n        *error = CPP2C_OK;\n    try {\n        "
+         << wf.body
+         << ";\n    } catch (...) {\n        cpp2c::setLastError();\n"
+            "        if (error)\n            *error = cpp2c::lastError();\n"
+            "    }";
+    if (wf.returnType != "void")
+      body << "\n    return {}";
+    checked.body = body.str();
+    return checked;
+  }
+
+  static void eraseAttributes(WrapperFunction &wf,
+                              std::initializer_list<StringRef> names) {
+    wf.attributes.erase(
+        std::remove_if(wf.attributes.begin(), wf.attributes.end(),
+                       [&](const string &attribute) {
+                         return llvm::is_contained(names, attribute);
+                       }),
+        wf.attributes.end());
+  }
 
-    for (const std::string &className : ClassList) {
-      OS.HeaderOS << "struct      W" << className
-                  << "; \n"
-                     "typedef     struct W"
-                  << className << " W" << className << ";\n";
-      // oss.push_back(std::move(os))
+  // The calls cwrapper_bench.cpp times for wf, left empty if the arguments
+  // or the object cannot be synthesized: scalars are 0 (false for bool), C
+  // strings "", and the object is default constructed.
+  static void benchCall(WrapperFunction &wf, const CXXMethodDecl *cmd,
+                        bool passSelf, const string &cxxClass) {
+    vector<string> args;
+    for (const ParmVarDecl *param : cmd->parameters()) {
+      QualType qt = param->getType().getCanonicalType();
+      if (qt->isLValueReferenceType() &&
+          qt.getNonReferenceType().isConstQualified())
+        qt = qt.getNonReferenceType().getUnqualifiedType();
+      if (qt->isBooleanType())
+        args.push_back("false");
+      else if (isCScalar(qt))
+        args.push_back("0");
+      else if (qt->isPointerType() && qt->getPointeeType()->isCharType() &&
+               qt->getPointeeType().isConstQualified())
+        args.push_back("\"\"");
+      else
+        return;
+    }
 
-      DeclarationMatcher classMatcher =
-          cxxMethodDecl(isPublic(), ofClass(hasName(className)))
-              .bind("publicMethodDecl");
-      Matcher.addMatcher(classMatcher, &HandlerForClassMatcher);
+    string call = cmd->getNameAsString() + "(" + llvm::join(args, ", ") + ")";
+    if (cmd->isStatic()) {
+      wf.benchDirect = cxxClass + "::" + call;
+    } else if (defaultConstructible(cmd->getParent())) {
+      wf.benchObject = cxxClass;
+      wf.benchDirect = "object." + call;
+    } else {
+      return;
     }
+    // without -accurate-signatures static methods still take a self
+    if (passSelf)
+      args.insert(args.begin(), cmd->isStatic() ? "nullptr" : "self");
+    wf.benchArgs = llvm::join(args, ", ");
   }
 
-  void HandleTranslationUnit(ASTContext &Context) override {
-    // Run the matchers when we have the whole TU parsed.
-    Matcher.matchAST(Context);
+  // whether "Class object;" compiles in the benchmark
+  static bool defaultConstructible(const CXXRecordDecl *crd) {
+    crd = crd->getDefinition();
+    if (!crd || crd->isAbstract() || !crd->hasDefaultConstructor())
+      return false;
+    if (const CXXDestructorDecl *dtor = crd->getDestructor())
+      if (dtor->getAccess() != AS_public || dtor->isDeleted())
+        return false;
+    for (const CXXConstructorDecl *ctor : crd->ctors())
+      if (ctor->getMinRequiredArguments() == 0)
+        return ctor->getAccess() == AS_public && !ctor->isDeleted();
+    return !crd->defaultedDefaultConstructorIsDeleted();
   }
 
-private:
-  OutputStreams &OS;
-  classMatchHandler HandlerForClassMatcher;
+  // -async, or __attribute__((annotate("cpp2c_async"))) on the method
+  static bool isAsync(const CXXMethodDecl *cmd, const string &className) {
+    for (const AnnotateAttr *attr : cmd->specific_attrs<AnnotateAttr>())
+      if (attr->getAnnotation() == "cpp2c_async")
+        return true;
+    return AsyncRegex &&
+           AsyncRegex->match(className + "::" + cmd->getNameAsString());
+  }
 
-  MatchFinder Matcher;
-};
+  // <Class>_<method>_submit(args..., [result,] user_data) queues the call for
+  // the workers of the async runtime, and returns 0, or -1 when the runtime is
+  // not started or has as many calls in flight as its capacity. A worker
+  // stores the return value through result, which may be NULL, before the
+  // completion of user_data can be polled. The arguments are copied, what
+  // they point to must stay valid until then.
+  static WrapperFunction asyncFunction(const WrapperFunction &wf,
+                                       bool returns) {
+    WrapperFunction async = wf;
+    async.methodName += "_submit";
+    async.returnType = "int";
+    async.cxxReturnType = "";
+    async.returnConversion = "none";
+    async.attributes.clear();
+    async.async = true;
 
-// For each source file provided to the tool, a new FrontendAction is created.
-class MyFrontendAction : public ASTFrontendAction {
-public:
-  MyFrontendAction() {
-    OS.HeaderOS << "#ifndef UTHREADS_CWRAPPER_H\n"
-                   "#define UTHREADS_CWRAPPER_H_\n"
-                   "#include <pthread.h>\n"
-                   "#include <sys/types.h>\n"
-                   "#include <sys/socket.h>\n"
-                   "#include <inttypes.h>\n\n"
-
-                   "#ifdef __cplusplus\n"
-                   "extern \"C\"{\n"
-                   "#endif\n"
-                   "#include <stdbool.h>\n";
-    OS.BodyOS << "#include \"generic/basics.h\"\n"
-                 "#include \"cwrapper.h\"\n"
-                 "#include \"runtime/uThread.h\"\n"
-                 "#include \"runtime/uThreadPool.h\"\n"
-                 "#include \"runtime/kThread.h\"\n"
-                 "#include \"io/Network.h\"\n"
-                 "#ifdef __cplusplus\n"
-                 "extern \"C\"{\n"
-                 "#endif\n";
+    string call = wf.body;
+    if (StringRef(call).startswith("return "))
+      call.erase(0, strlen("return "));
+    if (returns) {
+      async.params.push_back({"result", wf.returnType + "*",
+                              wf.cxxReturnType, "async-result"});
+      call = "if (result)\n            *result = " + call +
+             ";\n        else\n            " + call;
+    }
+    async.params.push_back({"user_data", "void*", "", "user-data"});
+    async.body = "return cpp2c::async::submit(user_data, [=]() {\n        " +
+                 call + ";\n    })";
+    return async;
   }
 
-  void EndSourceFileAction() override {
+  // <Class>_<method>_batch(selfs, n, [results,] args...) calls the method on
+  // n objects. The loop runs in the C++ translation unit, where the method
+  // can be inlined and the loop unrolled or vectorized. results may be NULL
+  // to discard the return values.
+  static WrapperFunction batchFunction(const WrapperFunction &wf,
+                                       bool returns) {
+    WrapperFunction batch = wf;
+    batch.methodName += "_batch";
+    batch.returnType = "void";
+    batch.cxxReturnType = "";
+    batch.returnConversion = "none";
+    batch.attributes.clear();
 
-    StringRef headerFile("cwrapper.h");
-    StringRef bodyFile("cwrapper.cpp");
+    // "W<Class>*" or "const W<Class>*". The array is only read, but C only
+    // converts a W<Class>** to W<Class>* const*, not to const W<Class>*
+    // const*, so const methods take the same array.
+    string selfType = wf.params.front().cType;
+    batch.params.front().name = "selfs";
+    StringRef handle(selfType);
+    handle.consume_front("const ");
+    batch.params.front().cType = handle.str() + " const*";
+    batch.params.insert(batch.params.begin() + 1,
+                        WrapperParam{"n", "size_t", "", "count"});
 
-    // Open the output file
-    std::error_code EC;
-    llvm::raw_fd_ostream HOS(headerFile, EC, llvm::sys::fs::F_None);
-    if (EC) {
-      llvm::errs() << "while opening '" << headerFile << "': " << EC.message()
-                   << '\n';
-      exit(1);
+    string call = wf.body;
+    if (StringRef(call).startswith("return "))
+      call.erase(0, strlen("return "));
+    // the loop over selfs, its first line is already indented
+    auto loop = [&](const string &indent, const string &statement) {
+      return "for (size_t i = 0; i < n; i++) {\n" + indent + "    " +
+             selfType + " self = selfs[i];\n" + indent + "    " + statement +
+             ";\n" + indent + "}";
+    };
+    if (!returns) {
+      batch.body = loop("    ", call);
+      return batch;
     }
-    llvm::raw_fd_ostream BOS(bodyFile, EC, llvm::sys::fs::F_None);
-    if (EC) {
-      llvm::errs() << "while opening '" << bodyFile << "': " << EC.message()
-                   << '\n';
-      exit(1);
+
+    batch.params.insert(batch.params.begin() + 2,
+                        WrapperParam{"results", wf.returnType + "*",
+                                     wf.cxxReturnType, "results"});
+    batch.body = "if (!results) {\n        " + loop("        ", call) +
+                 "\n        return;\n    }\n    " +
+                 loop("    ", "results[i] = " + call);
+    return batch;
+  }
+
+  // Whether the exception specification of the method says it cannot throw.
+  // Implicit members whose specification was never needed have none yet,
+  // only destructors are then known to be noexcept.
+  static bool isNothrow(const CXXMethodDecl *cmd) {
+    const FunctionProtoType *fpt = cmd->getType()->getAs<FunctionProtoType>();
+    if (!fpt)
+      return false;
+    if (isUnresolvedExceptionSpec(fpt->getExceptionSpecType()))
+      return isa<CXXDestructorDecl>(cmd);
+    return fpt->isNothrow();
+  }
+
+  // The attributes of the wrapper that follow from the declaration of the
+  // method it forwards to. placement is set for <Class>_init, which unlike
+  // <Class>_create does not allocate.
+  static vector<string> provenAttributes(ASTContext &Context,
+                                         const CXXMethodDecl *cmd,
+                                         const vector<unsigned> &nonnull,
+                                         bool placement) {
+    vector<string> attributes;
+    bool ctor = isa<CXXConstructorDecl>(cmd);
+    const QualType rt = cmd->getReturnType();
+
+    if (!ctor && (cmd->hasAttr<ConstAttr>() || isSideEffectFree(cmd, true)))
+      attributes.push_back("const");
+    else if (!ctor &&
+             (cmd->hasAttr<PureAttr>() || isSideEffectFree(cmd, false)))
+      attributes.push_back("pure");
+
+    bool noexceptCall = isNothrow(cmd);
+    // new can throw bad_alloc whatever the constructor
+    if ((noexceptCall && (!ctor || placement)) ||
+        (!ctor && isSideEffectFree(cmd, false)))
+      attributes.push_back("nothrow");
+
+    if (!nonnull.empty()) {
+      std::stringstream positions;
+      for (size_t i = 0; i < nonnull.size(); i++)
+        positions << (i ? ", " : "") << nonnull[i];
+      attributes.push_back("nonnull(" + positions.str() + ")");
     }
 
-    OS.HeaderOS << "#ifdef __cplusplus\n"
-                   "}\n"
-                   "#endif\n"
-                   "#endif /* UTHREADS_CWRAPPER_H_ */\n";
+    // objects created by the wrapper, and references returned as pointers
+    if (ctor || (rt->isReferenceType() && rt->getPointeeType()->isRecordType()))
+      attributes.push_back("returns_nonnull");
+    return attributes;
+  }
 
-    OS.BodyOS << "#ifdef __cplusplus\n"
-                 "}\n"
-                 "#endif\n";
+  // Records the field a getter returns as it is, "return member;" or "return
+  // this->member;", for -inline-accessors. The field belongs to the class
+  // itself, has the return type, and that type is a builtin or a pointer to
+  // one, so that C reads it with the same type.
+  void returnedField(WrapperFunction &wf, const CXXMethodDecl *cmd,
+                     const string &cxxClass) {
+    const CXXRecordDecl *parent = cmd->getParent();
+    const QualType rt = cmd->getReturnType();
+    const FunctionDecl *definition;
+    if (cmd->isStatic() || cmd->getNumParams() != 0 ||
+        isa<CXXConstructorDecl>(cmd) || isa<CXXDestructorDecl>(cmd) ||
+        (cmd->isVirtual() && !cmd->hasAttr<FinalAttr>() &&
+         !parent->isEffectivelyFinal()) ||
+        parent->getNumVBases() != 0 || rt->isVoidType() ||
+        !(rt->isBuiltinType() ||
+          (rt->isPointerType() && rt->getPointeeType()->isBuiltinType())) ||
+        !cmd->hasBody(definition))
+      return;
+    const CompoundStmt *body =
+        dyn_cast_or_null<CompoundStmt>(definition->getBody());
+    if (!body || body->size() != 1)
+      return;
+    const ReturnStmt *ret = dyn_cast<ReturnStmt>(body->body_front());
+    if (!ret || !ret->getRetValue())
+      return;
+    // the implicit casts are lvalue-to-rvalue, or a conversion the type
+    // comparison below rejects
+    const MemberExpr *member =
+        dyn_cast<MemberExpr>(ret->getRetValue()->IgnoreParenImpCasts());
+    if (!member || !isa<CXXThisExpr>(member->getBase()->IgnoreParenImpCasts()))
+      return;
+    const FieldDecl *field = dyn_cast<FieldDecl>(member->getMemberDecl());
+    if (!field || field->isBitField() ||
+        field->getType().isVolatileQualified() ||
+        field->getParent()->getCanonicalDecl() != parent->getCanonicalDecl() ||
+        !Context->hasSameUnqualifiedType(field->getType(), rt))
+      return;
 
-    OS.HeaderOS.flush();
-    OS.BodyOS.flush();
-    HOS << OS.headerString << "\n";
-    BOS << OS.bodyString << "\n";
+    const ASTRecordLayout &layout = Context->getASTRecordLayout(parent);
+    wf.fieldOffset =
+        Context
+            ->toCharUnitsFromBits(layout.getFieldOffset(field->getFieldIndex()))
+            .getQuantity();
+    // __builtin_offsetof is not a macro, commas of template arguments do
+    // not split it
+    string name = field->getNameAsString();
+    wf.fieldCheck = "__builtin_offsetof(" + cxxClass + ", " + name + "), " +
+                    std::to_string(wf.fieldOffset) + ", decltype(" +
+                    cxxClass + "::" + name + "), " +
+                    TypeName::getFullyQualifiedName(
+                        field->getType(), *Context,
+                        Context->getPrintingPolicy());
   }
 
-  std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI,
-                                                 StringRef file) override {
+  // Whether the method body is visible and is a single return of an
+  // expression without side effects (no call, no volatile access, no
+  // assignment). Without reads of memory either, it only depends on its
+  // arguments, which is what C calls const.
+  static bool isSideEffectFree(const CXXMethodDecl *cmd, bool noMemoryReads) {
+    const FunctionDecl *definition;
+    if (cmd->isVirtual() || !cmd->hasBody(definition) ||
+        cmd->getReturnType()->isVoidType())
+      return false;
+    const CompoundStmt *body =
+        dyn_cast_or_null<CompoundStmt>(definition->getBody());
+    if (!body || body->size() != 1)
+      return false;
+    const ReturnStmt *ret = dyn_cast<ReturnStmt>(body->body_front());
+    if (!ret || !ret->getRetValue())
+      return false;
+    const Expr *value = ret->getRetValue();
+    ASTContext &Context = definition->getASTContext();
+    if (value->HasSideEffects(Context, true))
+      return false;
+    return !noMemoryReads || (cmd->isStatic() && value->isEvaluatable(Context));
+  }
+
+  // size and alignment of each wrapped class, and of the classes returned by
+  // value, recorded once per TU
+  void recordLayout(ASTContext &Context, const CXXRecordDecl *crd,
+                    const string &className, bool byValue = false) {
+    auto recorded = RecordedClasses.try_emplace(className, TU.classes.size());
+    if (!recorded.second) {
+      if (recorded.first->second < TU.classes.size())
+        TU.classes[recorded.first->second].byValue |= byValue;
+      return;
+    }
+    if (crd->isInvalidDecl() || crd->isDependentType() ||
+        !crd->isCompleteDefinition()) {
+      recorded.first->second = SIZE_MAX;
+      return;
+    }
 
-    return std::make_unique<MyASTConsumer>(OS);
+    QualType qt = Context.getRecordType(crd);
+    WrapperClass wc;
+    wc.name = className;
+    wc.cxxName = qualifiedName(crd);
+    wc.size = Context.getTypeSizeInChars(qt).getQuantity();
+    wc.align = Context.getTypeAlignInChars(qt).getQuantity();
+    wc.byValue = byValue;
+    layoutMembers(Context, crd, wc.members);
+    TU.classes.push_back(std::move(wc));
   }
 
-private:
-  OutputStreams OS;
+  // The vtable pointer, bases and fields of crd with the bytes they occupy.
+  // Empty bases take no byte, and a bit-field the bytes its bits touch.
+  void layoutMembers(ASTContext &Context, const CXXRecordDecl *crd,
+                     vector<LayoutMember> &members) {
+    const ASTRecordLayout &layout = Context.getASTRecordLayout(crd);
+    const PrintingPolicy &policy = Context.getPrintingPolicy();
+    if (layout.hasOwnVFPtr()) {
+      LayoutMember vptr;
+      vptr.name = "<vptr>";
+      vptr.size = Context.toCharUnitsFromBits(Context.getTargetInfo()
+                                                  .getPointerWidth(0))
+                      .getQuantity();
+      members.push_back(vptr);
+    }
+
+    for (const CXXBaseSpecifier &base : crd->bases()) {
+      const CXXRecordDecl *bd = base.getType()->getAsCXXRecordDecl();
+      if (!bd || !bd->hasDefinition())
+        continue;
+      LayoutMember lm;
+      lm.name = "<base " + bd->getQualifiedNameAsString() + ">";
+      lm.type = TypeName::getFullyQualifiedName(base.getType(), Context,
+                                                policy);
+      lm.offset = (base.isVirtual() ? layout.getVBaseClassOffset(bd)
+                                    : layout.getBaseClassOffset(bd))
+                      .getQuantity();
+      lm.size = bd->isEmpty()
+                    ? 0
+                    : Context.getASTRecordLayout(bd)
+                          .getNonVirtualSize()
+                          .getQuantity();
+      lm.kind = synchronizationKind(base.getType());
+      members.push_back(lm);
+    }
+
+    for (const FieldDecl *field : crd->fields()) {
+      LayoutMember lm;
+      lm.name = field->getNameAsString();
+      lm.type = TypeName::getFullyQualifiedName(field->getType(), Context,
+                                                policy);
+      uint64_t bits = layout.getFieldOffset(field->getFieldIndex());
+      lm.offset = bits / 8;
+      if (field->isBitField())
+        lm.size = (bits % 8 + field->getBitWidthValue(Context) + 7) / 8;
+      else if (!field->isZeroSize(Context))
+        lm.size = Context.getTypeSizeInChars(field->getType()).getQuantity();
+      lm.kind = synchronizationKind(field->getType());
+      members.push_back(lm);
+    }
+  }
+
+  // "atomic" for std::atomic and _Atomic, "lock" for mutexes, condition
+  // variables and semaphores, and for a record the kind of its first such
+  // member, so that a lock inside a struct is found. The standard and
+  // pthread locks are matched exactly; other records are locks when a word
+  // of their name says so (Mutex, OwnerLock, SpinLock, but not Clock or
+  // LockGuard).
+  static string synchronizationKind(QualType qt, unsigned depth = 0) {
+    while (const auto *tt = qt->getAs<TypedefType>()) {
+      if (StringSwitch<bool>(tt->getDecl()->getName())
+              .Cases("pthread_mutex_t", "pthread_cond_t", "pthread_rwlock_t",
+                     "pthread_spinlock_t", true)
+              .Default(false))
+        return "lock";
+      qt = tt->desugar();
+    }
+    qt = qt.getCanonicalType();
+    while (const ArrayType *at = qt->getAsArrayTypeUnsafe())
+      qt = at->getElementType().getCanonicalType();
+    if (qt->isAtomicType())
+      return "atomic";
+
+    const CXXRecordDecl *rd = qt->getAsCXXRecordDecl();
+    if (!rd || !rd->hasDefinition())
+      return "";
+    StringRef name = rd->getName();
+    if (rd->isInStdNamespace()) {
+      if (name.startswith("atomic") || name == "__atomic_base")
+        return "atomic";
+      if (StringSwitch<bool>(name)
+              .Cases("mutex", "recursive_mutex", "timed_mutex",
+                     "recursive_timed_mutex", true)
+              .Cases("shared_mutex", "shared_timed_mutex", true)
+              .Cases("condition_variable", "condition_variable_any", true)
+              .Case("counting_semaphore", true)
+              .Default(false))
+        return "lock";
+    } else {
+      vector<string> words = identifierWords(name);
+      bool lock = !words.empty() &&
+                  StringSwitch<bool>(words.back())
+                      .Cases("lock", "spinlock", "rwlock", "condvar", true)
+                      .Default(false);
+      for (size_t i = 0; i < words.size(); i++)
+        lock |= words[i] == "mutex" || words[i] == "semaphore" ||
+                (words[i] == "condition" && i + 1 < words.size() &&
+                 words[i + 1] == "variable");
+      if (lock)
+        return "lock";
+    }
+
+    if (depth == 4)
+      return "";
+    rd = rd->getDefinition();
+    for (const CXXBaseSpecifier &base : rd->bases()) {
+      string kind = synchronizationKind(base.getType(), depth + 1);
+      if (!kind.empty())
+        return kind;
+    }
+    for (const FieldDecl *field : rd->fields()) {
+      string kind = synchronizationKind(field->getType(), depth + 1);
+      if (!kind.empty())
+        return kind;
+    }
+    return "";
+  }
+
+  // Whether crd is passed by value as a C struct of the same layout: the
+  // record is trivially copyable and standard-layout, the ABI passes it like
+  // a C struct, and every field has a C equivalent. The C definition is
+  // recorded the first time.
+  bool mirrorRecord(const CXXRecordDecl *crd) {
+    crd = crd ? crd->getDefinition() : nullptr;
+    if (!crd)
+      return false;
+    auto it = Mirrored.find(crd);
+    if (it != Mirrored.end())
+      return it->second;
+    Mirrored[crd] = false;
+
+    if (crd->isInvalidDecl() || crd->isDependentType() ||
+        !crd->isTriviallyCopyable() || !crd->isStandardLayout() ||
+        !crd->canPassInRegisters() || crd->getNumBases() != 0 ||
+        crd->field_empty())
+      return false;
+
+    MirroredRecord mr;
+    mr.name = "W" + cRecordName(crd);
+    string cxxName = qualifiedName(crd);
+    string keyword = crd->isUnion() ? "union " : "struct ";
+    string mismatch = "\"" + mr.name + " does not mirror " + cxxName + "\"";
+    const ASTRecordLayout &layout = Context->getASTRecordLayout(crd);
+
+    std::stringstream definition;
+    definition << keyword << mr.name << " {\n";
+    for (const FieldDecl *field : crd->fields()) {
+      string decl;
+      if (field->getName().empty() ||
+          !cFieldDecl(field->getType(), field->getNameAsString(), decl))
+        return false;
+      definition << "    " << decl;
+      if (field->isBitField())
+        definition << " : " << field->getBitWidthValue(*Context);
+      else
+        mr.checks.push_back(
+            "static_assert(offsetof(" + mr.name + ", " +
+            field->getNameAsString() + ") == " +
+            std::to_string(layout.getFieldOffset(field->getFieldIndex()) / 8) +
+            ", " + mismatch + ");");
+      definition << ";\n";
+    }
+    definition << "};\n";
+    // wrapped classes already have their typedef
+    if (!isWrappedClass(cClassName(crd)))
+      definition << "typedef " << keyword << mr.name << " " << mr.name
+                 << ";\n";
+    mr.definition = definition.str();
+    mr.checks.insert(mr.checks.begin(),
+                     "static_assert(sizeof(" + mr.name + ") == sizeof(" +
+                         cxxName + ") && alignof(" + mr.name +
+                         ") == alignof(" + cxxName + "), " + mismatch + ");");
+
+    TU.records.push_back(std::move(mr));
+    Mirrored[crd] = true;
+    return true;
+  }
+
+  // C declaration of the field name of a mirrored record, false if its type
+  // has no C equivalent. Pointers to classes that are not wrapped become
+  // void*, and enums their underlying type.
+  bool cFieldDecl(QualType qt, const string &name, string &decl) {
+    qt = qt.getCanonicalType().getUnqualifiedType();
+    if (const ConstantArrayType *cat = Context->getAsConstantArrayType(qt))
+      return cFieldDecl(cat->getElementType(),
+                        name + "[" +
+                            std::to_string(cat->getSize().getZExtValue()) +
+                            "]",
+                        decl);
+    if (const EnumType *et = qt->getAs<EnumType>())
+      qt = et->getDecl()->getIntegerType().getCanonicalType();
+
+    if (qt->isPointerType()) {
+      QualType pointee = qt->getPointeeType();
+      const CXXRecordDecl *crd = pointee->getAsCXXRecordDecl();
+      if (isCScalar(pointee) || pointee->isVoidType())
+        decl = qt.getAsString() + " " + name;
+      else if (crd && isWrappedClass(cClassName(crd)))
+        decl = "W" + cClassName(crd) + "* " + name;
+      else
+        decl = "void* " + name;
+      return true;
+    }
+    if (isCScalar(qt)) {
+      decl = qt.getAsString() + " " + name;
+      return true;
+    }
+    const CXXRecordDecl *nested = qt->getAsCXXRecordDecl();
+    if (nested && mirrorRecord(nested)) {
+      decl = "W" + cRecordName(nested) + " " + name;
+      return true;
+    }
+    return false;
+  }
+
+  // How a std::string, std::string_view, std::vector or std::span parameter
+  // or return value is passed as a pointer to its elements and a length.
+  struct ContainerLowering {
+    enum Kind { None, String, StringView, Vector, Span } kind = None;
+    bool view = false;     // refers to elements owned by someone else
+    string cxxType;        // fully qualified container type
+    string cElement;       // C element type of the pointer, const included
+    string cBufferElement; // C element type of a result buffer
+    string cxxPointer;     // C++ pointer type the elements are cast to
+  };
+
+  // Fills how qt is lowered, false if it is not one of these containers, if
+  // its elements have no C equivalent, or if it is passed by non-const
+  // reference (the C++ side could resize it).
+  bool lowerContainer(QualType qt, bool isReturn, ContainerLowering &out) {
+    QualType containerType = qt.getNonReferenceType();
+    const auto *spec = dyn_cast_or_null<ClassTemplateSpecializationDecl>(
+        containerType->getAsCXXRecordDecl());
+    if (!spec || !spec->isInStdNamespace() ||
+        spec->getTemplateArgs().size() == 0 ||
+        spec->getTemplateArgs()[0].getKind() != TemplateArgument::Type)
+      return false;
+
+    StringRef name = spec->getName();
+    ContainerLowering lowering;
+    if (name == "basic_string")
+      lowering.kind = ContainerLowering::String;
+    else if (name == "basic_string_view")
+      lowering.kind = ContainerLowering::StringView;
+    else if (name == "vector")
+      lowering.kind = ContainerLowering::Vector;
+    else if (name == "span")
+      lowering.kind = ContainerLowering::Span;
+    else
+      return false;
+
+    bool isView = lowering.kind == ContainerLowering::StringView ||
+                  lowering.kind == ContainerLowering::Span;
+    bool constRef = qt->isLValueReferenceType() &&
+                    containerType.isConstQualified();
+    if (qt->isLValueReferenceType() && !constRef)
+      return false;
+    // a returned reference is a view of the container it refers to
+    lowering.view = isView || (isReturn && constRef);
+
+    QualType element =
+        spec->getTemplateArgs()[0].getAsType().getCanonicalType();
+    QualType unqualified = element.getUnqualifiedType();
+    const CXXRecordDecl *elementRecord = unqualified->getAsCXXRecordDecl();
+    if (isCScalar(unqualified))
+      lowering.cBufferElement = unqualified.getAsString();
+    else if (elementRecord && mirrorRecord(elementRecord))
+      lowering.cBufferElement = "W" + cRecordName(elementRecord);
+    else
+      return false;
+    // vector<bool> has no data()
+    if (lowering.kind == ContainerLowering::Vector &&
+        unqualified->isBooleanType())
+      return false;
+
+    // only the elements of a span of non-const elements are writable
+    bool writable = lowering.kind == ContainerLowering::Span &&
+                    !element.isConstQualified();
+    string constness = writable ? "" : "const ";
+    lowering.cElement = constness + lowering.cBufferElement;
+    lowering.cxxPointer =
+        constness +
+        TypeName::getFullyQualifiedName(unqualified, *Context,
+                                        Context->getPrintingPolicy()) +
+        "*";
+    lowering.cxxType = TypeName::getFullyQualifiedName(
+        containerType.getUnqualifiedType(), *Context,
+        Context->getPrintingPolicy());
+    out = lowering;
+    return true;
+  }
+
+  // How a std::function parameter is passed as a typed C function pointer
+  // taking a void* context first, and called back from a lambda.
+  struct CallbackLowering {
+    string cxxType;      // fully qualified std::function type
+    string typedefName;  // cpp2c_fn_<result>_<params>
+    string lambdaParams; // "int a0, const char * a1"
+    string callArgs;     // ", a0, a1", converted to their C types
+    string resultPrefix; // converts the C result back to the C++ one
+    string resultSuffix;
+  };
+
+  // C type of a callback parameter or result and the conversion of the C++
+  // value to it, false if it has no C equivalent
+  bool callbackCType(QualType qt, string &cType, string &prefix,
+                     string &suffix) {
+    prefix = suffix = "";
+    QualType value = qt.getNonReferenceType();
+    QualType unqualified = value.getUnqualifiedType().getCanonicalType();
+    const CXXRecordDecl *record = unqualified->getAsCXXRecordDecl();
+    bool constRef = qt->isLValueReferenceType() && value.isConstQualified();
+    if (isCScalar(unqualified) && (!qt->isReferenceType() || constRef)) {
+      cType = unqualified.getAsString();
+    } else if (isCScalar(unqualified) && qt->isLValueReferenceType()) {
+      // written through by the C callback
+      cType = unqualified.getAsString() + "*";
+      prefix = "&";
+    } else if (qt->isPointerType() && qt->getPointeeType()->isBuiltinType()) {
+      cType = qt.getCanonicalType().getAsString();
+    } else if (record && mirrorRecord(record) &&
+               (!qt->isReferenceType() || constRef)) {
+      cType = "W" + cRecordName(record);
+      prefix = "cpp2c::mirror<" + cType + ">(";
+      suffix = ")";
+    } else if ((qt->isPointerType() || qt->isReferenceType()) &&
+               qt->getPointeeType()->isRecordType() &&
+               isWrappedClass(
+                   cClassName(qt->getPointeeType()->getAsCXXRecordDecl()))) {
+      QualType pointee = qt->getPointeeType();
+      cType = string(pointee.isConstQualified() ? "const " : "") + "W" +
+              cClassName(pointee->getAsCXXRecordDecl()) + "*";
+      prefix = "reinterpret_cast<" + cType + ">(" +
+               (qt->isReferenceType() ? "&" : "");
+      suffix = ")";
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  // Fills how a std::function parameter is lowered, false if qt is not one
+  // or if its signature has no C equivalent.
+  bool lowerCallback(QualType qt, CallbackLowering &out) {
+    QualType functionType = qt.getNonReferenceType();
+    const auto *spec = dyn_cast_or_null<ClassTemplateSpecializationDecl>(
+        functionType->getAsCXXRecordDecl());
+    if (!spec || !spec->isInStdNamespace() || spec->getName() != "function" ||
+        spec->getTemplateArgs().size() != 1 ||
+        spec->getTemplateArgs()[0].getKind() != TemplateArgument::Type)
+      return false;
+    // non-const references could be reassigned by the C++ side
+    if (qt->isLValueReferenceType() && !functionType.isConstQualified())
+      return false;
+    const auto *proto = spec->getTemplateArgs()[0]
+                            .getAsType()
+                            ->getAs<FunctionProtoType>();
+    if (!proto || proto->isVariadic())
+      return false;
+
+    CallbackLowering lowering;
+    string cResult, prefix, suffix;
+    QualType result = proto->getReturnType();
+    if (result->isVoidType()) {
+      cResult = "void";
+    } else if (!callbackCType(result, cResult, prefix, suffix) ||
+               result->isReferenceType()) {
+      return false;
+    } else if (prefix != "") {
+      // back from the C struct or handle to the C++ value
+      const CXXRecordDecl *record = result->getPointeeOrArrayElementType()
+                                        ->getAsCXXRecordDecl();
+      string cxxResult =
+          TypeName::getFullyQualifiedName(result, *Context,
+                                          Context->getPrintingPolicy());
+      lowering.resultPrefix =
+          record && !result->isPointerType()
+              ? "cpp2c::mirror<" + cxxResult + ">("
+              : "reinterpret_cast<" + cxxResult + ">(";
+      lowering.resultSuffix = ")";
+    }
+
+    vector<string> cParams{"void* ctx"};
+    string signature = cResult;
+    for (unsigned i = 0; i < proto->getNumParams(); i++) {
+      QualType param = proto->getParamType(i);
+      string cParam, arg = "a" + std::to_string(i);
+      if (!callbackCType(param, cParam, prefix, suffix))
+        return false;
+      cParams.push_back(cParam);
+      signature += " " + cParam;
+      if (i != 0)
+        lowering.lambdaParams += ", ";
+      lowering.lambdaParams +=
+          TypeName::getFullyQualifiedName(param, *Context,
+                                          Context->getPrintingPolicy()) +
+          " " + arg;
+      lowering.callArgs += ", " + prefix + arg + suffix;
+    }
+
+    // one typedef per C signature, e.g. cpp2c_fn_void_const_char_p
+    lowering.typedefName = "cpp2c_fn_" + cIdentifier(signature);
+    string typedefDecl = "typedef " + cResult + " (*" + lowering.typedefName +
+                         ")(" + llvm::join(cParams, ", ") + ");\n";
+    if (std::find(TU.callbackTypedefs.begin(), TU.callbackTypedefs.end(),
+                  typedefDecl) == TU.callbackTypedefs.end())
+      TU.callbackTypedefs.push_back(typedefDecl);
+
+    lowering.cxxType = TypeName::getFullyQualifiedName(
+        functionType.getUnqualifiedType(), *Context,
+        Context->getPrintingPolicy());
+    out = lowering;
+    return true;
+  }
+
+  // spec is the -instantiate specialization wrapped as cName
+  void addInstantiation(const ClassTemplateSpecializationDecl *spec,
+                        const string &cName) {
+    Instantiated[spec->getCanonicalDecl()] = cName;
+  }
+
+  // C name of a class, "RingBuffer_int" for an -instantiate specialization
+  string cClassName(const CXXRecordDecl *crd) const {
+    auto it = Instantiated.find(crd->getCanonicalDecl());
+    return it != Instantiated.end() ? it->second : crd->getNameAsString();
+  }
+
+  // C++ name of a class in the wrapper bodies, with the template arguments
+  // of an -instantiate specialization
+  string cxxClassName(const CXXRecordDecl *crd) const {
+    if (!isa<ClassTemplateSpecializationDecl>(crd))
+      return crd->getNameAsString();
+    return TypeName::getFullyQualifiedName(Context->getRecordType(crd),
+                                           *Context,
+                                           Context->getPrintingPolicy());
+  }
+
+  // C++ name of any record in the wrapper bodies, with its namespaces and
+  // template arguments, "std::shared_ptr<Socket>"
+  string qualifiedName(const CXXRecordDecl *crd) const {
+    return TypeName::getFullyQualifiedName(Context->getRecordType(crd),
+                                           *Context,
+                                           Context->getPrintingPolicy());
+  }
+
+  // C name of a record without the "W": the name of a wrapped class, or an
+  // identifier made of the qualified name of any other record, so that
+  // records of the same name in different namespaces or specializations of
+  // the same template do not collide, "std_shared_ptr_Socket"
+  string cRecordName(const CXXRecordDecl *crd) const {
+    string name = cClassName(crd);
+    return isWrappedClass(name) ? name : cIdentifier(qualifiedName(crd));
+  }
+
+  void addBodyInclude(const string &header) {
+    if (std::find(TU.bodyIncludes.begin(), TU.bodyIncludes.end(), header) ==
+        TU.bodyIncludes.end())
+      TU.bodyIncludes.push_back(header);
+  }
+
+  // builtin types spelled the same in C
+  static bool isCScalar(QualType qt) {
+    return qt->isBuiltinType() &&
+           (qt->isIntegerType() || qt->isRealFloatingType()) &&
+           !qt->isWideCharType() && !qt->isChar8Type() &&
+           !qt->isChar16Type() && !qt->isChar32Type();
+  }
+
+  // file:line:col of the declaration, using the real path of the file so the
+  // same header included from different TUs yields the same location
+  static string declLocation(const SourceManager &SM, const Decl *D) {
+    SourceLocation loc = SM.getFileLoc(D->getLocation());
+    string file;
+    if (const FileEntry *FE = SM.getFileEntryForID(SM.getFileID(loc))) {
+      file = FE->tryGetRealPathName().str();
+      if (file.empty())
+        file = FE->getName().str();
+    }
+    return file + ":" + std::to_string(SM.getSpellingLineNumber(loc)) + ":" +
+           std::to_string(SM.getSpellingColumnNumber(loc));
+  }
+
+  TUResult &TU;
+  ASTContext *Context = nullptr;
+  std::map<const Decl *, string> Instantiated;
+  llvm::StringMap<size_t> RecordedClasses; // index in TU.classes
+  map<const CXXRecordDecl *, bool> Mirrored;
 };
 
-int main(int argc, const char **argv) {
-  // parse the command-line args passed to your code
-  CommonOptionsParser op(argc, argv, CPP2CCategory);
-  // create a new Clang Tool instance (a LibTooling environment)
-  ClangTool Tool(op.getCompilations(), op.getSourcePathList());
+/****************** /Member Functions *******************************/
+// Finds the methods of the wrapped classes in one traversal of the TU, and
+// runs the method matcher on them alone. System headers are not traversed,
+// nor with -header-filter the headers that do not match, and class names
+// are looked up in a hash set, so the time depends on the size of the code
+// searched rather than on the number of wrapped classes.
+class WrappedMethodFinder : public RecursiveASTVisitor<WrappedMethodFinder> {
+public:
+  WrappedMethodFinder(ASTContext &context, MatchFinder &matcher,
+                      const llvm::StringSet<> &templates)
+      : Context(context), SM(context.getSourceManager()), Matcher(matcher),
+        Templates(templates) {}
+
+  // the specializations of -instantiate
+  bool shouldVisitTemplateInstantiations() const { return true; }
+
+  bool TraverseDecl(Decl *D) {
+    if (D && !isa<TranslationUnitDecl>(D) && !searched(D->getLocation()))
+      return true;
+    return RecursiveASTVisitor<WrappedMethodFinder>::TraverseDecl(D);
+  }
+
+  bool VisitCXXRecordDecl(CXXRecordDecl *RD) {
+    if (!RD->isThisDeclarationADefinition() || !RD->getIdentifier())
+      return true;
+    if (!isWrappedClass(RD->getName()) &&
+        !(isa<ClassTemplateSpecializationDecl>(RD) &&
+          Templates.count(RD->getName())))
+      return true;
+    // the declarations in the class, not the out-of-line definitions
+    for (CXXMethodDecl *method : RD->methods())
+      Matcher.match(*method, Context);
+    return true;
+  }
+
+private:
+  bool searched(SourceLocation loc) {
+    if (loc.isInvalid())
+      return true;
+    loc = SM.getFileLoc(loc);
+    if (SM.isInSystemHeader(loc))
+      return false;
+    if (!HeaderRegex || SM.isInMainFile(loc))
+      return true;
+    const FileEntry *FE = SM.getFileEntryForID(SM.getFileID(loc));
+    return FE && HeaderRegex->match(FE->getName());
+  }
+
+  ASTContext &Context;
+  const SourceManager &SM;
+  MatchFinder &Matcher;
+  const llvm::StringSet<> &Templates;
+};
+
+// Implementation of the ASTConsumer interface for reading an AST produced
+// by the Clang parser. It runs the method matcher on the methods of the
+// wrapped classes.
+class MyASTConsumer : public SemaConsumer {
+public:
+  MyASTConsumer(TUResult &result)
+      : Result(result), HandlerForClassMatcher(result) {
+    // only run on the methods of the wrapped classes, see WrappedMethodFinder
+    DeclarationMatcher methodMatcher =
+        cxxMethodDecl(isPublic()).bind("publicMethodDecl");
+    Matcher.addMatcher(methodMatcher, &HandlerForClassMatcher);
+    // the handler skips the specializations that were not asked for
+    for (const Instantiation &inst : Instantiations) {
+      StringRef name(inst.templateName);
+      Templates.insert(name.substr(name.rfind(':') + 1));
+    }
+  }
+
+  void InitializeSema(Sema &S) override { SemaRef = &S; }
+  void ForgetSema() override { SemaRef = nullptr; }
+
+  void HandleTranslationUnit(ASTContext &Context) override {
+    for (const Instantiation &inst : Instantiations)
+      if (const ClassTemplateSpecializationDecl *spec =
+              instantiate(Context, inst))
+        HandlerForClassMatcher.addInstantiation(spec, inst.cName);
+    // Run the matchers when we have the whole TU parsed.
+    auto start = std::chrono::steady_clock::now();
+    WrappedMethodFinder(Context, Matcher, Templates)
+        .TraverseDecl(Context.getTranslationUnitDecl());
+    Result.matchSeconds += std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+  }
+
+private:
+  // The specialization of an -instantiate entry, instantiated through Sema
+  // when the TU was parsed from source. ASTs loaded from a file only have the
+  // specializations their source used. Null if the template or one of the
+  // argument types is not declared in this TU.
+  const ClassTemplateSpecializationDecl *
+  instantiate(ASTContext &Context, const Instantiation &inst) {
+    auto *ctd = dyn_cast_or_null<ClassTemplateDecl>(
+        lookupQualified(Context, inst.templateName));
+    if (!ctd)
+      return nullptr;
+    const TemplateParameterList *params = ctd->getTemplateParameters();
+    if (inst.args.size() > params->size())
+      return nullptr;
+
+    const SourceManager &SM = Context.getSourceManager();
+    SourceLocation loc = SM.getLocForEndOfFile(SM.getMainFileID());
+    TemplateArgumentListInfo argsInfo(loc, loc);
+    vector<TemplateArgument> args;
+    for (size_t i = 0; i < inst.args.size(); i++) {
+      const NamedDecl *param = params->getParam(i);
+      if (const auto *nttp = dyn_cast<NonTypeTemplateParmDecl>(param)) {
+        QualType type = nttp->getType();
+        long long value;
+        if (!type->isIntegerType() ||
+            StringRef(inst.args[i]).getAsInteger(0, value))
+          return nullptr;
+        llvm::APSInt integral(
+            llvm::APInt(Context.getIntWidth(type), value, true),
+            type->isUnsignedIntegerType());
+        Expr *literal = IntegerLiteral::Create(Context, integral, type, loc);
+        args.emplace_back(Context, integral, type);
+        argsInfo.addArgument(
+            TemplateArgumentLoc(TemplateArgument(literal), literal));
+      } else if (isa<TemplateTypeParmDecl>(param)) {
+        QualType type = resolveType(Context, inst.args[i]);
+        if (type.isNull())
+          return nullptr;
+        args.emplace_back(type);
+        argsInfo.addArgument(
+            TemplateArgumentLoc(TemplateArgument(type),
+                                Context.getTrivialTypeSourceInfo(type, loc)));
+      } else {
+        return nullptr; // template template parameter
+      }
+    }
+
+    if (SemaRef) {
+      QualType specType =
+          SemaRef->CheckTemplateIdType(TemplateName(ctd), loc, argsInfo);
+      if (specType.isNull() ||
+          SemaRef->RequireCompleteType(loc, specType,
+                                       diag::err_incomplete_type))
+        return nullptr;
+      return dyn_cast_or_null<ClassTemplateSpecializationDecl>(
+          specType->getAsCXXRecordDecl());
+    }
+
+    // default arguments fill the ones that were not given
+    for (const ClassTemplateSpecializationDecl *spec : ctd->specializations()) {
+      const TemplateArgumentList &specArgs = spec->getTemplateArgs();
+      bool same = spec->hasDefinition() && specArgs.size() >= args.size();
+      for (size_t i = 0; same && i < args.size(); i++)
+        same = sameArgument(Context, specArgs[i], args[i]);
+      if (same)
+        return spec;
+    }
+    return nullptr;
+  }
+
+  static bool sameArgument(ASTContext &Context, const TemplateArgument &a,
+                           const TemplateArgument &b) {
+    if (a.getKind() != b.getKind())
+      return false;
+    if (a.getKind() == TemplateArgument::Type)
+      return Context.hasSameType(a.getAsType(), b.getAsType());
+    return a.getKind() == TemplateArgument::Integral &&
+           llvm::APSInt::isSameValue(a.getAsIntegral(), b.getAsIntegral());
+  }
+
+  // The declaration of "ns::Name" in the TU.
+  static NamedDecl *lookupQualified(ASTContext &Context, StringRef name) {
+    name.consume_front("::");
+    SmallVector<StringRef, 4> parts;
+    name.split(parts, "::");
+    DeclContext *dc = Context.getTranslationUnitDecl();
+    NamedDecl *found = nullptr;
+    for (StringRef part : parts) {
+      if (!dc)
+        return nullptr;
+      DeclContextLookupResult result = dc->lookup(&Context.Idents.get(part));
+      if (result.empty())
+        return nullptr;
+      found = result.front();
+      dc = dyn_cast<DeclContext>(found);
+    }
+    return found;
+  }
+
+  // A builtin or declared type with const and pointer declarators, such as
+  // "const Packet*", "unsigned long" or "std::size_t".
+  static QualType resolveType(ASTContext &Context, StringRef spelling) {
+    spelling = spelling.trim();
+    unsigned pointers = 0;
+    while (spelling.consume_back("*")) {
+      pointers++;
+      spelling = spelling.rtrim();
+    }
+    bool isConst = spelling.consume_front("const ");
+    if (spelling.consume_back(" const"))
+      isConst = true;
+    spelling = spelling.trim();
+
+    QualType type = llvm::StringSwitch<QualType>(spelling)
+                        .Case("bool", Context.BoolTy)
+                        .Case("char", Context.CharTy)
+                        .Case("signed char", Context.SignedCharTy)
+                        .Case("unsigned char", Context.UnsignedCharTy)
+                        .Case("short", Context.ShortTy)
+                        .Case("unsigned short", Context.UnsignedShortTy)
+                        .Case("int", Context.IntTy)
+                        .Cases("unsigned", "unsigned int",
+                               Context.UnsignedIntTy)
+                        .Case("long", Context.LongTy)
+                        .Case("unsigned long", Context.UnsignedLongTy)
+                        .Case("long long", Context.LongLongTy)
+                        .Case("unsigned long long", Context.UnsignedLongLongTy)
+                        .Case("float", Context.FloatTy)
+                        .Case("double", Context.DoubleTy)
+                        .Case("long double", Context.LongDoubleTy)
+                        .Case("void", Context.VoidTy)
+                        .Default(QualType());
+    if (type.isNull())
+      if (const auto *td = dyn_cast_or_null<TypeDecl>(
+              lookupQualified(Context, spelling)))
+        type = Context.getTypeDeclType(td);
+    if (type.isNull())
+      return type;
+    if (isConst)
+      type.addConst();
+    while (pointers--)
+      type = Context.getPointerType(type);
+    return type;
+  }
+
+  TUResult &Result;
+  classMatchHandler HandlerForClassMatcher;
+  llvm::StringSet<> Templates; // unqualified names of -instantiate templates
+  Sema *SemaRef = nullptr;
+
+  MatchFinder Matcher;
+};
+
+/** Include tracking **/
+// Records every file a TU reads. System headers are recorded too, a libstdc++
+// update changes the wrappers.
+class IncludeCollector : public DependencyCollector {
+public:
+  bool needSystemDependencies() override { return true; }
+};
+
+// Records the system headers included directly from user code, these are the
+// headers precompiled by -system-pch.
+class SystemIncludeCollector : public PPCallbacks {
+public:
+  SystemIncludeCollector(const SourceManager &sm, vector<string> &includes)
+      : SM(sm), Includes(includes) {}
+
+  void InclusionDirective(SourceLocation HashLoc, const Token &IncludeTok,
+                          StringRef FileName, bool IsAngled,
+                          CharSourceRange FilenameRange, const FileEntry *File,
+                          StringRef SearchPath, StringRef RelativePath,
+                          const clang::Module *Imported,
+                          SrcMgr::CharacteristicKind FileType) override {
+    if (File && IsAngled && SrcMgr::isSystem(FileType) &&
+        !SM.isInSystemHeader(HashLoc))
+      Includes.push_back("<" + FileName.str() + ">");
+  }
+
+private:
+  const SourceManager &SM;
+  vector<string> &Includes;
+};
+
+// For each source file provided to the tool, a new FrontendAction is created.
+// It only collects the wrappers of its TU, the output is written by main()
+// once all TUs are done.
+class MyFrontendAction : public ASTFrontendAction {
+public:
+  MyFrontendAction(TUResult &result) : Result(result) {}
+
+  std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI,
+                                                 StringRef file) override {
+    // the preprocessor exists but has not entered the main file yet
+    Includes = std::make_shared<IncludeCollector>();
+    Includes->attachToPreprocessor(CI.getPreprocessor());
+    if (!SystemPCH.empty())
+      CI.getPreprocessor().addPPCallbacks(
+          std::make_unique<SystemIncludeCollector>(CI.getSourceManager(),
+                                                   Result.systemIncludes));
+
+    return std::make_unique<MyASTConsumer>(Result);
+  }
+
+  void EndSourceFileAction() override {
+    Result.dependencies = Includes->getDependencies().vec();
+    Result.dependencies.push_back(getCurrentFile().str());
+  }
+
+private:
+  TUResult &Result;
+  std::shared_ptr<IncludeCollector> Includes;
+};
+
+// Writes the PCH of the -system-pch prefix header, recording what it read so
+// that later runs can tell whether it is still up to date.
+class GenerateSystemPCHAction : public GeneratePCHAction {
+public:
+  GenerateSystemPCHAction(TUResult &result) : Result(result) {}
+
+  bool BeginInvocation(CompilerInstance &CI) override {
+    // the tool strips -o from the command line
+    CI.getFrontendOpts().OutputFile = SystemPCH;
+    return true;
+  }
+
+  std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI,
+                                                 StringRef file) override {
+    Includes = std::make_shared<IncludeCollector>();
+    Includes->attachToPreprocessor(CI.getPreprocessor());
+    return GeneratePCHAction::CreateASTConsumer(CI, file);
+  }
+
+  void EndSourceFileAction() override {
+    Result.dependencies = Includes->getDependencies().vec();
+    GeneratePCHAction::EndSourceFileAction();
+  }
+
+private:
+  TUResult &Result;
+  std::shared_ptr<IncludeCollector> Includes;
+};
+
+// Creates the FrontendActions of one source file, all of them filling the
+// result slot of that file.
+template <typename ActionT>
+class MyFrontendActionFactory : public FrontendActionFactory {
+public:
+  MyFrontendActionFactory(TUResult &result) : Result(result) {}
+
+  std::unique_ptr<FrontendAction> create() override {
+    return std::make_unique<ActionT>(Result);
+  }
+
+private:
+  TUResult &Result;
+};
+
+/** Incremental cache **/
+// A cache entry holds the wrappers of one source file along with the content
+// hash of every file its TU read. Entries are named after the hash of the
+// source path, its compile command and the generator options, and stay valid
+// as long as none of the recorded files changed.
+const char *CacheFormatVersion = "cpp2c-cache-14";
+
+string hashString(StringRef data) {
+  llvm::MD5 Hash;
+  llvm::MD5::MD5Result Result;
+  Hash.update(data);
+  Hash.final(Result);
+  return Result.digest().str().str();
+}
+
+// returns an empty string if the file cannot be read
+string hashFile(StringRef path) {
+  auto buffer = llvm::MemoryBuffer::getFile(path);
+  if (!buffer)
+    return "";
+  return hashString((*buffer)->getBuffer());
+}
+
+// hash of every file in paths, keyed by absolute path
+llvm::json::Object hashDependencies(const vector<string> &paths) {
+  llvm::json::Object deps;
+  for (const string &dep : paths) {
+    SmallString<128> path(dep);
+    llvm::sys::fs::make_absolute(path);
+    deps[path.str().str()] = hashFile(path);
+  }
+  return deps;
+}
+
+bool dependenciesUnchanged(const llvm::json::Object *deps) {
+  if (!deps)
+    return false;
+  for (const auto &dep : *deps) {
+    auto hash = dep.second.getAsString();
+    if (!hash || hashFile(dep.first) != *hash)
+      return false;
+  }
+  return true;
+}
+
+// writes contents to path through a temporary file, so that concurrent or
+// interrupted runs never see a truncated file
+void writeJSONFile(StringRef path, const llvm::json::Value &contents) {
+  string buffer;
+  llvm::raw_string_ostream OS(buffer);
+  OS << contents;
+  OS.flush();
+
+  if (llvm::Error E = llvm::writeFileAtomically(
+          (path + "-%%%%%%%%.tmp").str(), path, buffer))
+    llvm::errs() << "warning: could not write '" << path
+                 << "': " << llvm::toString(std::move(E)) << '\n';
+}
+
+// options that change the generated wrappers, part of every cache key
+string generatorOptions() {
+  std::stringstream options;
+  options << "classes=" << ClassesToGenrate << ";placement=" << Placement
+          << ";pooled=" << llvm::join(Pooled, ",")
+          << ";accurate-signatures=" << AccurateSignatures
+          << ";batch=" << BatchPattern << ";async=" << AsyncPattern
+          << ";exception-boundary=" << ExceptionBoundary
+          << ";instantiate=" << Instantiate
+          << ";overhead-bench=" << OverheadBench
+          << ";header-filter=" << HeaderFilter
+          << ";align-create=" << AlignCreate << ";cache-line=" << CacheLineSize;
+  return options.str();
+}
+
+string cacheKey(const CompilationDatabase &db, StringRef source) {
+  std::stringstream key;
+  key << CacheFormatVersion << "\n" << generatorOptions() << "\n" << source;
+  for (const CompileCommand &cc : db.getCompileCommands(source))
+    key << "\n" << cc.Directory << "\n" << llvm::join(cc.CommandLine, " ");
+  return hashString(key.str());
+}
+
+string cacheEntryPath(StringRef key) {
+  SmallString<128> path(CacheDir);
+  llvm::sys::path::append(path, key + ".json");
+  return path.str().str();
+}
+
+bool loadCacheEntry(StringRef key, TUResult &result) {
+  auto buffer = llvm::MemoryBuffer::getFile(cacheEntryPath(key));
+  if (!buffer)
+    return false;
+  llvm::Expected<llvm::json::Value> entry =
+      llvm::json::parse((*buffer)->getBuffer());
+  if (!entry) {
+    llvm::consumeError(entry.takeError());
+    return false;
+  }
+  const llvm::json::Object *obj = entry->getAsObject();
+  if (!obj || !dependenciesUnchanged(obj->getObject("dependencies")))
+    return false;
+
+  const llvm::json::Value *extracted = obj->get("result");
+  llvm::json::Path::Root root;
+  return extracted && fromJSON(*extracted, result, root);
+}
+
+void storeCacheEntry(StringRef key, const TUResult &result) {
+  writeJSONFile(cacheEntryPath(key),
+                llvm::json::Object{
+                    {"dependencies", hashDependencies(result.dependencies)},
+                    {"result", result}});
+}
+
+/** Emission **/
+// Files whose content did not change are left alone, so their timestamp does
+// not trigger a rebuild of everything including them.
+void writeOutputFile(StringRef fileName, const string &contents) {
+  auto existing = llvm::MemoryBuffer::getFile(fileName);
+  if (existing && (*existing)->getBuffer() == contents + "\n")
+    return;
+
+  // Open the output file
+  std::error_code EC;
+  llvm::raw_fd_ostream OFS(fileName, EC, llvm::sys::fs::F_None);
+  if (EC) {
+    llvm::errs() << "while opening '" << fileName << "': " << EC.message()
+                 << '\n';
+    exit(1);
+  }
+  OFS << contents << "\n";
+}
+
+// Object pool behind the _create/_destroy wrappers of -pooled classes. It is
+// written to the body ahead of the extern "C" block.
+const char *PoolRuntime = R"(#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <utility>
+
+namespace cpp2c {
+// Fixed-size object pool for one wrapped class. Slots are carved out of
+// slabs that are never given back to the system. Every thread keeps a cache
+// of free slots and only takes the pool lock to exchange half a cache with
+// the shared free list, so most _create/_destroy calls do not contend.
+template <typename T> class SlabPool {
+  union Slot {
+    Slot *next;
+    alignas(T) unsigned char storage[sizeof(T)];
+  };
+  enum { SlabSlots = 256, CacheSlots = 64 };
+
+  struct ThreadCache {
+    Slot *head = nullptr;
+    size_t count = 0;
+    // only written by the owning thread, read by printStats
+    std::atomic<size_t> creates{0}, destroys{0};
+    ThreadCache *prev = nullptr, *next = nullptr;
+
+    ThreadCache() { instance().attach(this); }
+    ~ThreadCache() { instance().detach(this); }
+
+    static void bump(std::atomic<size_t> &counter) {
+      counter.store(counter.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+    }
+  };
+
+  std::mutex lock;
+  Slot *freeList = nullptr;
+  size_t freeCount = 0, capacity = 0;
+  size_t exitedCreates = 0, exitedDestroys = 0;
+  ThreadCache *caches = nullptr;
+
+  static ThreadCache &cache() {
+    static thread_local ThreadCache threadCache;
+    return threadCache;
+  }
+
+  // called with the lock held. The slab is aligned for T even when new
+  // does not know over-aligned types, before C++17.
+  void grow(size_t slots) {
+    void *memory = nullptr;
+    if (posix_memalign(&memory,
+                       alignof(Slot) > sizeof(void *) ? alignof(Slot)
+                                                      : sizeof(void *),
+                       slots * sizeof(Slot)))
+      throw std::bad_alloc();
+    Slot *slab = static_cast<Slot *>(memory);
+    for (size_t i = 0; i < slots; i++) {
+      slab[i].next = freeList;
+      freeList = &slab[i];
+    }
+    freeCount += slots;
+    capacity += slots;
+  }
+
+  void attach(ThreadCache *c) {
+    std::lock_guard<std::mutex> guard(lock);
+    c->next = caches;
+    if (caches)
+      caches->prev = c;
+    caches = c;
+  }
+
+  // the free slots of an exiting thread go back to the shared list
+  void detach(ThreadCache *c) {
+    std::lock_guard<std::mutex> guard(lock);
+    while (c->head) {
+      Slot *s = c->head;
+      c->head = s->next;
+      s->next = freeList;
+      freeList = s;
+      freeCount++;
+    }
+    exitedCreates += c->creates.load(std::memory_order_relaxed);
+    exitedDestroys += c->destroys.load(std::memory_order_relaxed);
+    if (c->prev)
+      c->prev->next = c->next;
+    else
+      caches = c->next;
+    if (c->next)
+      c->next->prev = c->prev;
+  }
+
+  Slot *pop(ThreadCache &c) {
+    if (!c.head) {
+      std::lock_guard<std::mutex> guard(lock);
+      if (freeCount == 0)
+        grow(SlabSlots);
+      while (freeList && c.count < CacheSlots / 2) {
+        Slot *s = freeList;
+        freeList = s->next;
+        freeCount--;
+        s->next = c.head;
+        c.head = s;
+        c.count++;
+      }
+    }
+    Slot *s = c.head;
+    c.head = s->next;
+    c.count--;
+    return s;
+  }
+
+  void push(ThreadCache &c, Slot *s) {
+    s->next = c.head;
+    c.head = s;
+    c.count++;
+    if (c.count > CacheSlots) {
+      std::lock_guard<std::mutex> guard(lock);
+      while (c.count > CacheSlots / 2) {
+        Slot *f = c.head;
+        c.head = f->next;
+        c.count--;
+        f->next = freeList;
+        freeList = f;
+        freeCount++;
+      }
+    }
+  }
+
+public:
+  // never destroyed, threads may still release objects while exiting
+  static SlabPool &instance() {
+    static SlabPool *pool = new SlabPool;
+    return *pool;
+  }
+
+  // like new T(args...), the slot is released if the constructor throws
+  template <typename... Args> T *create(Args &&... args) {
+    ThreadCache &c = cache();
+    Slot *s = pop(c);
+    T *object;
+    try {
+      object = new (s->storage) T(std::forward<Args>(args)...);
+    } catch (...) {
+      push(c, s);
+      throw;
+    }
+    ThreadCache::bump(c.creates);
+    return object;
+  }
+
+  // like delete object
+  void destroy(T *object) {
+    if (!object)
+      return;
+    object->~T();
+    ThreadCache &c = cache();
+    push(c, reinterpret_cast<Slot *>(object));
+    ThreadCache::bump(c.destroys);
+  }
+
+  // makes sure count more objects can be created without growing the pool
+  void reserve(size_t count) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (freeCount < count)
+      grow(count - freeCount);
+  }
+
+  void printStats(const char *name, FILE *out) {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t creates = exitedCreates, destroys = exitedDestroys;
+    for (ThreadCache *c = caches; c; c = c->next) {
+      creates += c->creates.load(std::memory_order_relaxed);
+      destroys += c->destroys.load(std::memory_order_relaxed);
+    }
+    fprintf(out, "%-24s %12zu %12zu %12zu %12zu %12zu\n", name, capacity,
+            creates - destroys, creates, destroys, freeCount);
+  }
+};
+} // namespace cpp2c
+)";
+
+// Conversion of trivially copyable values to their C mirror, written to the
+// body ahead of the extern "C" block when records are mirrored.
+const char *MirrorRuntime = R"(#include <cstddef>
+#include <cstring>
+
+namespace cpp2c {
+// copies a trivially copyable C++ value into the C struct mirroring it
+template <typename To, typename From>
+static inline To mirror(const From &from) {
+  static_assert(sizeof(To) == sizeof(From), "not a mirror");
+  To to;
+  std::memcpy(&to, &from, sizeof(To));
+  return to;
+}
+} // namespace cpp2c
+)";
+
+// Records the exception caught by a wrapper, written to the body ahead of the
+// extern "C" block when -exception-boundary is set.
+const char *ErrorRuntime = R"(#include <exception>
+#include <new>
+#include <string>
+#include <system_error>
+
+namespace cpp2c {
+// inline, so every file of sharded wrappers shares the same error
+inline cpp2c_error &lastError() {
+  static thread_local cpp2c_error error = CPP2C_OK;
+  return error;
+}
+
+inline std::string &lastErrorMessage() {
+  static thread_local std::string message;
+  return message;
+}
+
+// called from a catch block
+inline void setLastError() {
+  try {
+    throw;
+  } catch (const std::bad_alloc &e) {
+    lastError() = CPP2C_BAD_ALLOC;
+    lastErrorMessage() = e.what();
+  } catch (const std::system_error &e) {
+    lastError() = CPP2C_SYSTEM_ERROR;
+    lastErrorMessage() = e.what();
+  } catch (const std::exception &e) {
+    lastError() = CPP2C_EXCEPTION;
+    lastErrorMessage() = e.what();
+  } catch (...) {
+    lastError() = CPP2C_UNKNOWN_EXCEPTION;
+    lastErrorMessage() = "unknown exception";
+  }
+}
+} // namespace cpp2c
+)";
+
+// C API of -exception-boundary
+void emitErrorAPI(OutputStreams &OS) {
+  if (!ExceptionBoundary)
+    return;
+  OS.HeaderOS << "CPP2C_API cpp2c_error cpp2c_last_error(void);\n"
+                 "CPP2C_API const char* cpp2c_last_error_message(void);\n"
+                 "CPP2C_API void cpp2c_clear_error(void);\n";
+  OS.BodyOS << "cpp2c_error cpp2c_last_error(void){\n"
+               "    return cpp2c::lastError(); \n}\n"
+               "const char* cpp2c_last_error_message(void){\n"
+               "    return cpp2c::lastError() == CPP2C_OK ? nullptr : "
+               "cpp2c::lastErrorMessage().c_str(); \n}\n"
+               "void cpp2c_clear_error(void){\n"
+               "    cpp2c::lastError() = CPP2C_OK; \n}\n";
+}
+
+// C API of the -pooled classes, after all the wrappers
+void emitPoolAPI(OutputStreams &OS) {
+  vector<string> pooled;
+  for (const std::string &className : ClassList)
+    if (isPooled(className))
+      pooled.push_back(className);
+  if (pooled.empty())
+    return;
+
+  for (const string &className : pooled) {
+    OS.HeaderOS << "CPP2C_API void " << className
+                << "_pool_reserve(size_t count);\n";
+    OS.BodyOS << "void " << className << "_pool_reserve(size_t count){\n"
+              << "    cpp2c::SlabPool<" << className
+              << ">::instance().reserve(count); \n}\n";
+  }
+
+  OS.HeaderOS << "CPP2C_API void cpp2c_pool_stats(FILE* out);\n";
+  OS.BodyOS << "void cpp2c_pool_stats(FILE* out){\n"
+               "    fprintf(out, \"%-24s %12s %12s %12s %12s %12s\\n\", "
+               "\"pool\", \"capacity\", \"live\", \"created\", "
+               "\"destroyed\", \"shared free\");\n";
+  for (const string &className : pooled)
+    OS.BodyOS << "    cpp2c::SlabPool<" << className
+              << ">::instance().printStats(\"" << className << "\", out);\n";
+  OS.BodyOS << "}\n";
+}
+
+// Allocation of -align-create, written to the body ahead of the extern "C"
+// block. Every object of _create starts a cache line and its size is
+// rounded up to whole lines, so that no other allocation shares its lines.
+const char *AlignedRuntime = R"(#include <cstdlib>
+#include <new>
+#include <utility>
+
+namespace cpp2c {
+template <typename T, typename... Args> T *createAligned(Args &&...args) {
+  const size_t align = alignof(T) > CacheLine ? alignof(T) : CacheLine;
+  void *storage;
+  if (posix_memalign(&storage, align, (sizeof(T) + align - 1) / align * align))
+    throw std::bad_alloc();
+  try {
+    return new (storage) T(std::forward<Args>(args)...);
+  } catch (...) {
+    std::free(storage);
+    throw;
+  }
+}
+
+template <typename T> void destroyAligned(T *object) {
+  if (object) {
+    object->~T();
+    std::free(object);
+  }
+}
+}
+)";
+
+// Runtime of the -async _submit wrappers, written to the body ahead of the
+// extern "C" block. A submitted call is copied into a bounded lock-free ring,
+// worker threads run it and push its completion to a second ring, then
+// signal an eventfd the C event loop can wait on. A call is in flight from
+// its submission until its completion is polled, and at most capacity calls
+// are, so pushing to either ring only waits for a pop finishing with a cell.
+const char *AsyncRuntime = R"(#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace cpp2c {
+namespace async {
+// Bounded multi-producer multi-consumer queue after Dmitry Vyukov's. The
+// sequence number of a cell tells whether it is free for the producer of a
+// position or full for its consumer, so a push or a pop is a CAS on its index
+// and a release store.
+template <typename T> class Ring {
+public:
+  explicit Ring(size_t capacity)
+      : cells(new Cell[capacity]), mask(capacity - 1) {
+    for (size_t i = 0; i < capacity; i++)
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  ~Ring() { delete[] cells; }
+
+  bool push(const T &value) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell &cell = cells[pos & mask];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+          cell.value = value;
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool pop(T &value) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell &cell = cells[pos & mask];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      intptr_t diff = intptr_t(sequence) - intptr_t(pos + 1);
+      if (diff == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+          value = cell.value;
+          cell.sequence.store(pos + mask + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+  Cell *cells;
+  size_t mask;
+  // producers and consumers do not share a cache line
+  char padTail[64];
+  std::atomic<size_t> tail{0};
+  char padHead[64];
+  std::atomic<size_t> head{0};
+};
+
+// a submitted call, the lambda of a _submit wrapper copied to call
+struct Task {
+  void (*invoke)(void *call);
+  void *userData;
+  alignas(std::max_align_t) unsigned char call[128];
+};
+
+class Executor {
+public:
+  explicit Executor(size_t capacity)
+      : submissions(capacity), completions(capacity), capacity(capacity),
+        fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {}
+
+  ~Executor() {
+    if (fd >= 0)
+      close(fd);
+  }
+
+  void startThreads(unsigned workers) {
+    for (unsigned i = 0; i < workers; i++) {
+      enlist();
+      threads.emplace_back([this] { work(); });
+    }
+  }
+
+  template <typename F> bool submit(void *userData, const F &call) {
+    static_assert(std::is_trivially_copyable<F>::value &&
+                      sizeof(F) <= sizeof(Task::call),
+                  "too many arguments for an async call");
+    if (inFlight.fetch_add(1, std::memory_order_relaxed) >= capacity) {
+      inFlight.fetch_sub(1, std::memory_order_relaxed);
+      return false;
+    }
+    Task task;
+    task.invoke = [](void *p) { (*static_cast<F *>(p))(); };
+    task.userData = userData;
+    std::memcpy(task.call, &call, sizeof(F));
+    // counted before it is pushed, so that the worker popping it never sees
+    // queued at 0, and a worker going to sleep either sees the call or is
+    // woken up. The push is never abandoned: inFlight leaves it room.
+    queued.fetch_add(1);
+    while (!submissions.push(task))
+      std::this_thread::yield();
+    if (sleepers.load()) {
+      std::lock_guard<std::mutex> guard(lock);
+      wakeup.notify_one();
+    }
+    return true;
+  }
+
+  // counts the calling thread as a worker stop() waits for, before work()
+  void enlist() {
+    std::lock_guard<std::mutex> guard(lock);
+    active++;
+  }
+
+  // runs the submitted calls until stop() and no call is left, on a thread
+  // that called enlist()
+  void work() {
+    isWorker() = true;
+    for (;;) {
+      if (runOne())
+        continue;
+      std::unique_lock<std::mutex> guard(lock);
+      sleepers.fetch_add(1);
+      wakeup.wait(guard, [this] { return queued.load() != 0 || stopping; });
+      sleepers.fetch_sub(1);
+      if (stopping && queued.load() == 0)
+        break;
+    }
+    isWorker() = false;
+    std::lock_guard<std::mutex> guard(lock);
+    if (--active == 0)
+      idle.notify_all();
+  }
+
+  // runs a submitted call and queues its completion, false if none is left
+  bool runOne() {
+    Task task;
+    if (!submissions.pop(task))
+      return false;
+    queued.fetch_sub(1);
+    cpp2c_completion done = {task.userData, 0};
+    try {
+      task.invoke(task.call);
+    } catch (...) {
+      done.error = 1;
+    }
+    while (!completions.push(done))
+      std::this_thread::yield();
+    uint64_t one = 1;
+    ssize_t written = write(fd, &one, sizeof(one));
+    (void)written;
+    return true;
+  }
+
+  // whether the calling thread runs work(), where stop() would wait for
+  // itself
+  static bool &isWorker() {
+    thread_local bool worker = false;
+    return worker;
+  }
+
+  size_t poll(cpp2c_completion *out, size_t max) {
+    size_t n = 0;
+    while (n < max && completions.pop(out[n]))
+      n++;
+    inFlight.fetch_sub(n, std::memory_order_relaxed);
+    return n;
+  }
+
+  // The calls already submitted are run first, by the calling thread when
+  // there is no worker left to run them. No call may be submitted anymore.
+  void stop() {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      stopping = true;
+      wakeup.notify_all();
+      idle.wait(guard, [this] { return active == 0; });
+    }
+    for (std::thread &thread : threads)
+      thread.join();
+    isWorker() = true;
+    while (runOne())
+      ;
+    isWorker() = false;
+  }
+
+  Ring<Task> submissions;
+  Ring<cpp2c_completion> completions;
+  const size_t capacity;
+  const int fd;
+
+private:
+  std::atomic<size_t> inFlight{0};
+  std::atomic<size_t> queued{0};
+  std::atomic<unsigned> sleepers{0};
+  std::mutex lock;
+  std::condition_variable wakeup, idle;
+  bool stopping = false;
+  unsigned active = 0;
+  std::vector<std::thread> threads;
+};
+
+// inline, so every file of sharded wrappers shares the same executor
+inline std::atomic<Executor *> &instance() {
+  static std::atomic<Executor *> executor(nullptr);
+  return executor;
+}
+
+// The calls using the executor, which stop() waits for before deleting it,
+// counted by epoch. stop() moves the later calls to the other epoch and only
+// waits for the current one, so that a stream of new calls cannot starve it.
+struct Users {
+  std::atomic<unsigned> epoch{0};
+  std::atomic<size_t> count[2] = {{0}, {0}};
+};
+
+inline Users &users() {
+  static Users instance;
+  return instance;
+}
+
+// The executor, or nullptr if not started or stopped, which stays valid
+// while the Use lives. The count is raised before the executor is loaded, so
+// stop() either sees the count or made the executor nullptr first.
+struct Use {
+  Use() : epoch(users().epoch.load()) {
+    users().count[epoch].fetch_add(1);
+    executor = instance().load();
+  }
+  ~Use() { users().count[epoch].fetch_sub(1); }
+  Use(const Use &) = delete;
+  Use &operator=(const Use &) = delete;
+
+  unsigned epoch;
+  Executor *executor;
+};
+
+template <typename F> inline int submit(void *userData, const F &call) {
+  Use use;
+  return use.executor && use.executor->submit(userData, call) ? 0 : -1;
+}
+
+// a worker until stop(), if started
+inline void worker() {
+  Executor *executor;
+  {
+    Use use;
+    executor = use.executor;
+    if (!executor)
+      return;
+    // counted before the Use ends, so stop() waits for the work() below
+    executor->enlist();
+  }
+  executor->work();
+}
+
+inline int fd() {
+  Use use;
+  return use.executor ? use.executor->fd : -1;
+}
+
+inline size_t poll(cpp2c_completion *completions, size_t max) {
+  Use use;
+  return use.executor ? use.executor->poll(completions, max) : 0;
+}
+
+inline int start(unsigned workers, size_t capacity) {
+  size_t size = 2;
+  while (size < capacity)
+    size *= 2;
+  Executor *executor = new Executor(size);
+  Executor *none = nullptr;
+  if (executor->fd < 0 || !instance().compare_exchange_strong(none, executor)) {
+    delete executor;
+    return -1;
+  }
+  executor->startThreads(workers);
+  return 0;
+}
+
+// -1 from a worker, which stop() would wait for
+inline int stop() {
+  if (Executor::isWorker())
+    return -1;
+  if (Executor *executor = instance().exchange(nullptr)) {
+    // the calls that loaded it are in the current epoch and short, the
+    // later ones see nullptr
+    unsigned current = users().epoch.fetch_xor(1);
+    while (users().count[current].load() != 0)
+      std::this_thread::yield();
+    executor->stop();
+    delete executor;
+  }
+  return 0;
+}
+}
+}
+)";
+
+// C API of the -async runtime, after all the wrappers
+void emitAsyncAPI(OutputStreams &OS, bool async) {
+  if (!async)
+    return;
+  OS.HeaderOS << "CPP2C_API int cpp2c_async_start(unsigned workers, "
+                 "size_t capacity);\n"
+                 "CPP2C_API void cpp2c_async_worker(void);\n"
+                 "CPP2C_API int cpp2c_async_fd(void);\n"
+                 "CPP2C_API size_t cpp2c_async_poll(cpp2c_completion* "
+                 "completions, size_t max);\n"
+                 "CPP2C_API int cpp2c_async_stop(void);\n";
+  OS.BodyOS << "int cpp2c_async_start(unsigned workers, size_t capacity){\n"
+               "    return cpp2c::async::start(workers, capacity); \n}\n"
+               "void cpp2c_async_worker(void){\n"
+               "    cpp2c::async::worker(); \n}\n"
+               "int cpp2c_async_fd(void){\n"
+               "    return cpp2c::async::fd(); \n}\n"
+               "size_t cpp2c_async_poll(cpp2c_completion* completions, "
+               "size_t max){\n"
+               "    return cpp2c::async::poll(completions, max); \n}\n"
+               "int cpp2c_async_stop(void){\n"
+               "    return cpp2c::async::stop(); \n}\n";
+}
+
+// -instrument: a probe at the top of every wrapper, whose destructor adds the
+// call and its latency to counters of the calling thread. Only the owning
+// thread writes its counters, with relaxed loads and stores, so a call takes
+// no lock and no atomic read-modify-write. Threads register once, dumps sum
+// every live thread plus the ones that exited, and a reset records the sums
+// as the new origin instead of writing to the counters of other threads.
+// Without CPP2C_STATS the probes expand to nothing.
+const char *StatsRuntime = R"(#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+
+namespace cpp2c {
+namespace stats {
+// bucket b holds the calls that took less than 2^b ns, the last one the rest
+enum { Buckets = 32 };
+
+struct Counters {
+  std::atomic<uint64_t> calls, ns, histogram[Buckets];
+};
+
+struct Totals {
+  uint64_t calls, ns, histogram[Buckets];
+};
+
+struct Registry;
+
+struct ThreadStats {
+  Counters counters[Wrappers];
+  ThreadStats *prev = nullptr, *next = nullptr;
+
+  ThreadStats();
+  ~ThreadStats();
+};
+
+struct Registry {
+  std::mutex lock;
+  ThreadStats *threads = nullptr;
+  Totals exited[Wrappers];
+  Totals origin[Wrappers]; // the sums at the last reset
+
+  static Registry &instance() {
+    static Registry registry;
+    return registry;
+  }
+
+  // called with the lock held
+  void sum(Totals *totals) {
+    for (size_t i = 0; i < Wrappers; i++)
+      totals[i] = exited[i];
+    for (ThreadStats *t = threads; t; t = t->next)
+      for (size_t i = 0; i < Wrappers; i++) {
+        const Counters &c = t->counters[i];
+        totals[i].calls += c.calls.load(std::memory_order_relaxed);
+        totals[i].ns += c.ns.load(std::memory_order_relaxed);
+        for (int b = 0; b < Buckets; b++)
+          totals[i].histogram[b] +=
+              c.histogram[b].load(std::memory_order_relaxed);
+      }
+  }
+};
+
+inline ThreadStats::ThreadStats() {
+  Registry &r = Registry::instance();
+  std::lock_guard<std::mutex> guard(r.lock);
+  next = r.threads;
+  if (r.threads)
+    r.threads->prev = this;
+  r.threads = this;
+}
+
+// the counts of an exiting thread are kept in exited
+inline ThreadStats::~ThreadStats() {
+  Registry &r = Registry::instance();
+  std::lock_guard<std::mutex> guard(r.lock);
+  for (size_t i = 0; i < Wrappers; i++) {
+    r.exited[i].calls += counters[i].calls.load(std::memory_order_relaxed);
+    r.exited[i].ns += counters[i].ns.load(std::memory_order_relaxed);
+    for (int b = 0; b < Buckets; b++)
+      r.exited[i].histogram[b] +=
+          counters[i].histogram[b].load(std::memory_order_relaxed);
+  }
+  if (prev)
+    prev->next = next;
+  else
+    r.threads = next;
+  if (next)
+    next->prev = prev;
+}
+
+static inline void bump(std::atomic<uint64_t> &counter, uint64_t n) {
+  counter.store(counter.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+}
+
+class Probe {
+  size_t id;
+  std::chrono::steady_clock::time_point start;
+
+public:
+  explicit Probe(size_t id)
+      : id(id), start(std::chrono::steady_clock::now()) {}
+  ~Probe() {
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    static thread_local ThreadStats thread;
+    Counters &c = thread.counters[id];
+    bump(c.calls, 1);
+    bump(c.ns, ns);
+    bump(c.histogram[bucket < Buckets ? bucket : Buckets - 1], 1);
+  }
+};
+
+inline void dump(const char *const *names) {
+  Registry &r = Registry::instance();
+  static Totals totals[Wrappers];
+  std::lock_guard<std::mutex> guard(r.lock);
+  r.sum(totals);
+  for (size_t i = 0; i < Wrappers; i++) {
+    uint64_t calls = totals[i].calls - r.origin[i].calls;
+    if (calls == 0)
+      continue;
+    uint64_t ns = totals[i].ns - r.origin[i].ns;
+    std::fprintf(stderr, "%-40s %12llu calls %10.1f ns/call |", names[i],
+                 (unsigned long long)calls, (double)ns / calls);
+    for (int b = 0; b < Buckets; b++)
+      if (uint64_t n = totals[i].histogram[b] - r.origin[i].histogram[b])
+        std::fprintf(stderr, " <2^%d:%llu", b, (unsigned long long)n);
+    std::fprintf(stderr, "\n");
+  }
+}
+
+inline void reset() {
+  Registry &r = Registry::instance();
+  std::lock_guard<std::mutex> guard(r.lock);
+  r.sum(r.origin);
+}
+} // namespace stats
+} // namespace cpp2c
+#define CPP2C_PROBE(id) cpp2c::stats::Probe cpp2c_probe(id)
+)";
+
+// cpp2c_stats_dump()/cpp2c_stats_reset(), after all the wrappers. They do
+// nothing when cwrapper.cpp is compiled without CPP2C_STATS.
+void emitStatsAPI(OutputStreams &OS, const vector<string> &names) {
+  if (!Instrument)
+    return;
+  OS.HeaderOS << "CPP2C_API void cpp2c_stats_dump(void);\n"
+                 "CPP2C_API void cpp2c_stats_reset(void);\n";
+  OS.BodyOS << "#ifdef CPP2C_STATS\n"
+               "static const char *const cpp2c_wrapper_names[] = {";
+  for (size_t i = 0; i < names.size(); i++)
+    OS.BodyOS << (i ? ", " : "") << "\"" << names[i] << "\"";
+  OS.BodyOS << "};\n"
+               "#endif\n"
+               "void cpp2c_stats_dump(void){\n"
+               "#ifdef CPP2C_STATS\n"
+               "    cpp2c::stats::dump(cpp2c_wrapper_names);\n"
+               "#endif\n"
+               "}\n"
+               "void cpp2c_stats_reset(void){\n"
+               "#ifdef CPP2C_STATS\n"
+               "    cpp2c::stats::reset();\n"
+               "#endif\n"
+               "}\n";
+}
+
+// The C++ headers of the wrapped classes, after cwrapper.h
+const char *WrappedIncludes = "#include \"generic/basics.h\"\n"
+                              "#include \"cwrapper.h\"\n"
+                              "#include \"runtime/uThread.h\"\n"
+                              "#include \"runtime/uThreadPool.h\"\n"
+                              "#include \"runtime/kThread.h\"\n"
+                              "#include \"io/Network.h\"\n";
+
+// Timing loop of cwrapper_bench.cpp. Each call is separated by a compiler
+// barrier and its result kept, so neither the wrapper nor the inlined C++
+// call is hoisted out of the loop or discarded. The median of five runs is
+// reported.
+const char *BenchRuntime = R"(#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+namespace cpp2c_bench {
+template <typename T> static inline void keep(T &&value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+template <typename F> static double nsPerCall(F call) {
+  using Clock = std::chrono::steady_clock;
+  const long iterations = 1000000;
+  for (long i = 0; i < iterations / 10; i++)
+    call();
+  double runs[5];
+  for (double &run : runs) {
+    auto start = Clock::now();
+    for (long i = 0; i < iterations; i++) {
+      call();
+      asm volatile("" : : : "memory");
+    }
+    run = std::chrono::duration<double, std::nano>(Clock::now() - start)
+              .count() /
+          iterations;
+  }
+  std::sort(runs, runs + 5);
+  return runs[2];
+}
+
+static int flagged = 0;
+
+static void report(const char *name, double wrapped, double direct,
+                   double threshold) {
+  bool over = wrapped - direct > threshold;
+  flagged += over;
+  std::printf("%-40s %10.2f %10.2f %10.2f  %s\n", name, wrapped, direct,
+              wrapped - direct, over ? "over" : "");
+}
+} // namespace cpp2c_bench
+)";
+
+// One timed call of cwrapper_bench.cpp: the wrapper name, then the method
+// called directly on the same object.
+void emitBenchCall(OutputStreams &OS, const WrapperFunction &wf,
+                   const string &name) {
+  string keep = wf.returnType == "void" ? "(" : "cpp2c_bench::keep(";
+  OS.BenchOS << "    {\n";
+  if (!wf.benchObject.empty())
+    OS.BenchOS << "        " << wf.benchObject << " object;\n"
+               << "        auto self = reinterpret_cast<W" << wf.className
+               << "*>(&object);\n";
+  OS.BenchOS << "        double wrapped = cpp2c_bench::nsPerCall([&] { "
+             << keep << name << "(" << wf.benchArgs << ")); });\n"
+             << "        double direct = cpp2c_bench::nsPerCall([&] { "
+             << keep << wf.benchDirect << "); });\n"
+             << "        cpp2c_bench::report(\"" << name
+             << "\", wrapped, direct, threshold);\n"
+             << "    }\n";
+}
+
+// Removes the shards and unity files listed by the cwrapper_sources.cmake of
+// an earlier run that are not in written, so that neither the list nor a
+// glob of the output directory compiles a stale shard twice.
+void removeStaleShards(const std::set<string> &written) {
+  auto list = llvm::MemoryBuffer::getFile("cwrapper_sources.cmake");
+  if (!list)
+    return;
+  SmallVector<StringRef, 64> lines;
+  (*list)->getBuffer().split(lines, '\n');
+  for (StringRef line : lines) {
+    StringRef name = line.trim().rtrim(')').trim('"');
+    if (!name.consume_front("${CMAKE_CURRENT_LIST_DIR}/") ||
+        !name.startswith("cwrapper_") || !name.endswith(".cpp") ||
+        name.contains('/') || written.count(name.str()))
+      continue;
+    if (std::error_code EC = llvm::sys::fs::remove(name))
+      llvm::errs() << "warning: could not remove '" << name
+                   << "': " << EC.message() << '\n';
+  }
+}
+
+// With -shard-by-class or -shard-size the wrapper bodies are written to
+// cwrapper_<...>.cpp files, each one as soon as it is full or, by class, as
+// soon as the wrappers of the next class start, instead of being kept in
+// cwrapper.cpp. Every shard starts with the includes and runtimes of
+// cwrapper.cpp, guarded so that a unity file can include several shards.
+// cwrapper_sources.cmake lists the files to compile, and the files of an
+// earlier run that were not written again are removed.
+class ShardWriter {
+public:
+  ShardWriter(const string &prologue) : Prologue(prologue) {}
+
+  void add(const string &className, const string &text) {
+    string group = ShardByClass ? className : "";
+    // the wrappers of a class are emitted together, a class met again
+    // later goes to its next part
+    if (group != Current) {
+      auto current = Shards.find(Current);
+      if (current != Shards.end() && !current->second.text.empty())
+        flush(Current, current->second);
+      Current = group;
+    }
+    auto it = Shards.find(group);
+    if (it == Shards.end()) {
+      it = Shards.emplace(group, Shard()).first;
+      Order.push_back(group);
+    }
+    it->second.text += text;
+    if (ShardSize && it->second.text.size() >= ShardSize)
+      flush(group, it->second);
+  }
+
+  void finish() {
+    for (const string &group : Order)
+      if (!Shards[group].text.empty())
+        flush(group, Shards[group]);
+
+    vector<string> sources{"cwrapper.cpp"};
+    if (!UnityShards) {
+      sources.insert(sources.end(), Files.begin(), Files.end());
+    } else {
+      for (size_t i = 0; i < Files.size(); i += UnityShards) {
+        string unity =
+            "cwrapper_unity_" + std::to_string(i / UnityShards) + ".cpp";
+        std::stringstream includes;
+        for (size_t j = i; j < Files.size() && j < i + UnityShards; j++)
+          includes << "#include \"" << Files[j] << "\"\n";
+        writeOutputFile(unity, includes.str());
+        sources.push_back(unity);
+      }
+    }
+
+    std::set<string> written(sources.begin(), sources.end());
+    written.insert(Files.begin(), Files.end());
+    removeStaleShards(written);
+
+    std::stringstream list;
+    list << "# Generated by cpp2c, do not edit.\n"
+            "set(CWRAPPER_SOURCES";
+    for (const string &source : sources)
+      list << "\n    \"${CMAKE_CURRENT_LIST_DIR}/" << source << "\"";
+    list << ")";
+    // included by the unity files
+    if (UnityShards) {
+      list << "\nset(CWRAPPER_SHARDS";
+      for (const string &file : Files)
+        list << "\n    \"${CMAKE_CURRENT_LIST_DIR}/" << file << "\"";
+      list << ")";
+    }
+    writeOutputFile("cwrapper_sources.cmake", list.str());
+  }
+
+private:
+  struct Shard {
+    string text;
+    unsigned count = 0; // shards of the group already written
+  };
+
+  // cwrapper_<Class>.cpp, cwrapper_<Class>_1.cpp, ... or cwrapper_<n>.cpp
+  void flush(const string &group, Shard &shard) {
+    string name = "cwrapper";
+    if (!group.empty())
+      name += "_" + group;
+    if (group.empty() || shard.count)
+      name += "_" + std::to_string(shard.count);
+    name += ".cpp";
+    shard.count++;
+
+    writeOutputFile(name, "#ifndef CPP2C_SHARD_PROLOGUE\n"
+                          "#define CPP2C_SHARD_PROLOGUE\n" +
+                              Prologue +
+                              "#endif\n"
+                              "#ifdef __cplusplus\n"
+                              "extern \"C\"{\n"
+                              "#endif\n" +
+                              shard.text +
+                              "#ifdef __cplusplus\n"
+                              "}\n"
+                              "#endif");
+    Files.push_back(name);
+    shard.text.clear();
+  }
+
+  string Prologue;
+  std::map<string, Shard> Shards;
+  string Current; // the group of the last wrapper
+  vector<string> Order; // groups in the order of their first wrapper
+  vector<string> Files;
+};
+
+/** A wrapper in emission order, with its overload-numbered C name **/
+struct NumberedWrapper {
+  const WrapperFunction *wf;
+  string name;      // "Connection_recv_1"
+  int overload = 0; // 0 for the first wrapper of the name
+};
+
+// The wrappers of every TU in emission order, a method declared in a header
+// shared by several TUs only once. A wrapper whose C name was already used,
+// whatever its return type, is numbered after the previous one.
+vector<NumberedWrapper> numberWrappers(const vector<TUResult> &TUResults) {
+  vector<NumberedWrapper> numbered;
+  std::set<string> emitted;
+  llvm::StringMap<int> overloads;
+  for (const TUResult &result : TUResults) {
+    for (const WrapperFunction &wf : result.functions) {
+      if (!emitted.insert(wf.key()).second)
+        continue;
+      NumberedWrapper nw;
+      nw.wf = &wf;
+      nw.name = wf.className + wf.methodName;
+      nw.overload = ++overloads.try_emplace(nw.name, -1).first->second;
+      if (nw.overload)
+        nw.name += "_" + std::to_string(nw.overload);
+      numbered.push_back(std::move(nw));
+    }
+  }
+  return numbered;
+}
+
+// Merge the per-TU results into one header/body pair. TUs are visited in
+// source-list order and methods in declaration order, a method declared in a
+// header shared by several TUs is emitted once, so the output does not depend
+// on which thread finished first.
+void emitWrappers(OutputStreams &OS, const vector<TUResult> &TUResults) {
+  // the first TU defining a class or a mirrored record wins
+  vector<const WrapperClass *> classes;
+  vector<const MirroredRecord *> records;
+  std::set<string> seenClasses, seenRecords;
+  bool storage = Placement;
+  std::set<string> bodyIncludes;
+  std::set<string> keys; // the wrappers, numbered for -instrument
+  // the probes of -instrument are in the out-of-line wrappers
+  bool inlineAccessors = InlineAccessors && !Instrument;
+  bool async = false; // -async or annotated methods
+  for (const TUResult &result : TUResults) {
+    for (const WrapperFunction &wf : result.functions) {
+      keys.insert(wf.key());
+      async |= wf.async;
+      if (inlineAccessors && wf.fieldOffset >= 0) {
+        bodyIncludes.insert("<cstddef>");
+        bodyIncludes.insert("<type_traits>");
+      }
+    }
+    bodyIncludes.insert(result.bodyIncludes.begin(), result.bodyIncludes.end());
+    for (const WrapperClass &wc : result.classes)
+      if (seenClasses.insert(wc.name).second) {
+        classes.push_back(&wc);
+        storage |= wc.byValue;
+      }
+    for (const MirroredRecord &mr : result.records)
+      if (seenRecords.insert(mr.name).second)
+        records.push_back(&mr);
+  }
+
+  OS.HeaderOS << "#ifndef UTHREADS_CWRAPPER_H\n"
+                 "#define UTHREADS_CWRAPPER_H\n"
+                 "#include <pthread.h>\n"
+                 "#include <sys/types.h>\n"
+                 "#include <sys/socket.h>\n"
+                 "#include <inttypes.h>\n";
+  if (!Pooled.empty())
+    OS.HeaderOS << "#include <stdio.h>\n";
+  OS.HeaderOS << "\n"
+                 "#ifdef __cplusplus\n"
+                 "extern \"C\"{\n"
+                 "#endif\n"
+                 "#include <stdbool.h>\n";
+  // every C function of the wrappers is exported, and only them when the
+  // library is compiled with -fvisibility=hidden
+  OS.HeaderOS << "#ifndef CPP2C_API\n"
+                 "#if defined(__GNUC__) || defined(__clang__)\n"
+                 "#define CPP2C_API __attribute__((visibility(\"default\")))\n"
+                 "#else\n"
+                 "#define CPP2C_API\n"
+                 "#endif\n"
+                 "#endif\n";
+  if (AccurateSignatures || ExceptionBoundary)
+    OS.HeaderOS << "#if defined(__GNUC__) || defined(__clang__)\n"
+                   "#define CPP2C_ATTR(...) __attribute__((__VA_ARGS__))\n"
+                   "#else\n"
+                   "#define CPP2C_ATTR(...)\n"
+                   "#endif\n";
+  // set by the wrappers of methods that threw, until cpp2c_clear_error()
+  if (ExceptionBoundary)
+    OS.HeaderOS << "typedef enum {\n"
+                   "    CPP2C_OK = 0,\n"
+                   "    CPP2C_BAD_ALLOC,\n"
+                   "    CPP2C_SYSTEM_ERROR,\n"
+                   "    CPP2C_EXCEPTION,\n"
+                   "    CPP2C_UNKNOWN_EXCEPTION\n"
+                   "} cpp2c_error;\n";
+  // what cpp2c_async_poll() returns for every finished _submit call
+  if (async)
+    OS.HeaderOS << "typedef struct {\n"
+                   "    void* user_data; /* as passed to the _submit call */\n"
+                   "    int error;       /* 1 if the method threw */\n"
+                   "} cpp2c_completion;\n";
+  // what the wrapper bodies need, repeated in every shard
+  std::stringstream prologue;
+  if (storage)
+    bodyIncludes.insert("<new>");
+  for (const string &header : bodyIncludes)
+    prologue << "#include " << header << "\n";
+  prologue << WrappedIncludes;
+  if (!Pooled.empty())
+    prologue << PoolRuntime;
+  if (!records.empty())
+    prologue << MirrorRuntime;
+  if (ExceptionBoundary)
+    prologue << ErrorRuntime;
+  if (async)
+    prologue << AsyncRuntime;
+  if (AlignCreate)
+    prologue << "namespace cpp2c {\n"
+                "enum : size_t { CacheLine = "
+             << CacheLineSize << " };\n}\n"
+             << AlignedRuntime;
+  if (Instrument)
+    prologue << "#ifdef CPP2C_STATS\n"
+                "namespace cpp2c {\n"
+                "namespace stats {\n"
+                "enum : size_t { Wrappers = "
+             << std::max<size_t>(keys.size(), 1)
+             << " };\n"
+                "}\n"
+                "}\n"
+             << StatsRuntime
+             << "#else\n"
+                "#define CPP2C_PROBE(id)\n"
+                "#endif\n";
+  OS.BodyOS << prologue.str();
+  OS.BodyOS << "#ifdef __cplusplus\n"
+               "extern \"C\"{\n"
+               "#endif\n";
+  std::unique_ptr<ShardWriter> shards;
+  if (ShardByClass || ShardSize)
+    shards = std::make_unique<ShardWriter>(prologue.str());
+
+  for (const std::string &className : ClassList) {
+    OS.HeaderOS << "struct      W" << className
+                << "; \n"
+                   "typedef     struct W"
+                << className << " W" << className << ";\n";
+  }
+  // handles of the other records passed or returned by value
+  for (const WrapperClass *wc : classes)
+    if (!isWrappedClass(wc->name))
+      OS.HeaderOS << "struct      W" << wc->name << "; \n"
+                  << "typedef     struct W" << wc->name << " W" << wc->name
+                  << ";\n";
+
+  for (const MirroredRecord *mr : records) {
+    OS.HeaderOS << mr->definition;
+    for (const string &check : mr->checks)
+      OS.BodyOS << check << "\n";
+  }
+
+  // callbacks may take the mirrored records, so they come after them
+  std::set<string> callbackTypedefs;
+  for (const TUResult &result : TUResults)
+    for (const string &typedefDecl : result.callbackTypedefs)
+      if (callbackTypedefs.insert(typedefDecl).second)
+        OS.HeaderOS << typedefDecl;
+
+  vector<NumberedWrapper> numbered = numberWrappers(TUResults);
+  std::set<string> wrapperNames;
+  for (const NumberedWrapper &nw : numbered)
+    wrapperNames.insert(nw.name);
+
+  // storage for <Class>_init and for records returned by value, checked
+  // against the C++ layout in the body. A record returned by value gets a
+  // <Record>_fini destroying it in place, unless the -placement _fini of
+  // its class is one.
+  for (const WrapperClass *wc : classes) {
+    if (!Placement && !wc->byValue)
+      continue;
+    OS.HeaderOS << "enum { " << wc->name << "_sizeof = " << wc->size << ", "
+                << wc->name << "_alignof = " << wc->align << " };\n";
+    OS.BodyOS << "static_assert(sizeof(" << wc->cxxName << ") == " << wc->name
+              << "_sizeof && alignof(" << wc->cxxName << ") == " << wc->name
+              << "_alignof, \"" << wc->name
+              << " layout changed, regenerate the wrappers\");\n";
+    if (wc->byValue && !wrapperNames.count(wc->name + "_fini")) {
+      OS.HeaderOS << "CPP2C_API void " << wc->name << "_fini(W" << wc->name
+                  << "* self);\n";
+      OS.BodyOS << "void " << wc->name << "_fini(W" << wc->name
+                << "* self){\n"
+                << "    typedef " << wc->cxxName << " T;\n"
+                << "    reinterpret_cast<T*>(self)->~T(); \n}\n";
+    }
+  }
+
+  vector<string> names; // of the wrappers in emission order
+  std::stringstream fieldChecks;
+  int fieldCount = 0;
+  for (const NumberedWrapper &nw : numbered) {
+    const WrapperFunction &wf = *nw.wf;
+    std::stringstream funcname;
+    funcname << wf.returnType << " " << nw.name << "("
+             << wf.paramList() << ")";
+
+    // -inline-accessors: the field is read where the C code calls, and
+    // the body only checks that it is still where the header reads it
+    if (inlineAccessors && wf.fieldOffset >= 0) {
+      OS.HeaderOS << "static inline " << funcname.str() << " {\n"
+                  << "    return *(" << wf.returnType
+                  << " const*)((const char*)self + " << wf.fieldOffset
+                  << ");\n}\n";
+      fieldChecks << "// " << nw.name << "\n"
+                  << "template struct cpp2c::FieldCheck<" << fieldCount++
+                  << ", " << wf.fieldCheck << ">;\n";
+      if (!wf.benchDirect.empty())
+        emitBenchCall(OS, wf, nw.name);
+      continue;
+    }
+
+    // the calls counted by -instrument must not be merged or dropped
+    vector<string> attributes = wf.attributes;
+    if (Instrument)
+      llvm::erase_if(attributes, [](const string &attribute) {
+        return attribute == "pure" || attribute == "const";
+      });
+    if (!attributes.empty())
+      OS.HeaderOS << "CPP2C_ATTR(" << llvm::join(attributes, ", ") << ") ";
+    OS.HeaderOS << "CPP2C_API " << funcname.str() << ";\n";
+
+    std::stringstream body;
+    body << funcname.str() << "{\n    ";
+    if (Instrument)
+      body << "CPP2C_PROBE(" << names.size() << ");\n    ";
+    body << wf.body << "; \n}\n";
+    if (shards)
+      shards->add(wf.className, body.str());
+    else
+      OS.BodyOS << body.str();
+    names.push_back(nw.name);
+
+    if (!wf.benchDirect.empty())
+      emitBenchCall(OS, wf, nw.name);
+  }
+
+  if (shards)
+    shards->finish();
+
+  // Instantiating FieldCheck fails to compile when a field read by cwrapper.h
+  // moved or changed type. Names in an explicit instantiation are not subject
+  // to access checks, so private fields can be checked too.
+  if (fieldCount)
+    OS.BodyOS << "extern \"C++\" {\n"
+                 "namespace cpp2c {\n"
+                 "template <int Id, std::size_t Offset, std::size_t Expected,\n"
+                 "          typename Field, typename ExpectedField>\n"
+                 "struct FieldCheck {\n"
+                 "    static_assert(Offset == Expected &&\n"
+                 "                      std::is_same<Field, "
+                 "ExpectedField>::value,\n"
+                 "                  \"field layout changed, regenerate the "
+                 "wrappers\");\n"
+                 "};\n"
+                 "}\n"
+                 "#pragma GCC diagnostic push\n"
+                 "#pragma GCC diagnostic ignored \"-Winvalid-offsetof\"\n"
+              << fieldChecks.str()
+              << "#pragma GCC diagnostic pop\n"
+                 "}\n";
+
+  emitPoolAPI(OS);
+  emitErrorAPI(OS);
+  emitAsyncAPI(OS, async);
+  emitStatsAPI(OS, names);
+
+  OS.HeaderOS << "#ifdef __cplusplus\n"
+                 "}\n"
+                 "#endif\n"
+                 "#endif /* UTHREADS_CWRAPPER_H */\n";
+
+  OS.BodyOS << "#ifdef __cplusplus\n"
+               "}\n"
+               "#endif\n";
+
+  OS.HeaderOS.flush();
+  OS.BodyOS.flush();
+}
+
+// cwrapper_bench.cpp, a program printing the ns/call of every timed wrapper
+// and of the direct call, flagging the wrappers whose overhead is above the
+// threshold given as first argument. It exits with 1 if any was flagged.
+void writeOverheadBench(OutputStreams &OS) {
+  OS.BenchOS.flush();
+  std::stringstream bench;
+  bench << BenchRuntime << WrappedIncludes << "\n"
+        << "int main(int argc, char **argv) {\n"
+        << "    double threshold = argc > 1 ? std::atof(argv[1]) : "
+        << OverheadThreshold.getValue() << ";\n"
+        << "    std::printf(\"%-40s %10s %10s %10s\\n\", \"wrapper\", "
+           "\"C ns\", \"C++ ns\", \"overhead\");\n"
+        << OS.benchString
+        << "    std::printf(\"%d wrappers over %.2f ns/call of overhead\\n\", "
+           "cpp2c_bench::flagged, threshold);\n"
+        << "    return cpp2c_bench::flagged ? 1 : 0;\n"
+        << "}";
+  writeOutputFile("cwrapper_bench.cpp", bench.str());
+}
+
+// -layout-report: for every wrapped class, its members with the cache lines
+// they span, the padding holes, and warnings for the atomics and locks that
+// share a line with another member ("shared-line"), or whose object may
+// share a line with another heap allocation because it does not come from
+// an -align-create _create, pool slots included ("heap-neighbours"). Lines
+// are counted from the start of the object, as if it started a line. The
+// JSON is stable, so CI can diff it or count the warnings.
+void writeLayoutReport(const vector<TUResult> &TUResults) {
+  const int64_t line = std::max<unsigned>(CacheLineSize, 1);
+  std::set<string> seen;
+  llvm::json::Array classes;
+  int64_t warningCount = 0;
+  std::set<string> created; // classes with a _create wrapper
+  for (const TUResult &result : TUResults)
+    for (const WrapperFunction &wf : result.functions)
+      if (wf.methodName == "_create")
+        created.insert(wf.className);
+  for (const TUResult &result : TUResults) {
+    for (const WrapperClass &wc : result.classes) {
+      if (!isWrappedClass(wc.name) || !seen.insert(wc.name).second)
+        continue;
+
+      auto lastLine = [&](const LayoutMember &lm) {
+        return (lm.offset + std::max<int64_t>(lm.size, 1) - 1) / line;
+      };
+      llvm::json::Array members;
+      bool synchronized = false;
+      for (const LayoutMember &lm : wc.members) {
+        llvm::json::Value member = lm;
+        member.getAsObject()->try_emplace(
+            "lines", llvm::json::Array{lm.offset / line, lastLine(lm)});
+        members.push_back(std::move(member));
+        synchronized |= !lm.kind.empty();
+      }
+
+      // the bytes no member covers, members sorted by offset
+      vector<const LayoutMember *> sorted;
+      for (const LayoutMember &lm : wc.members)
+        sorted.push_back(&lm);
+      std::stable_sort(sorted.begin(), sorted.end(),
+                       [](const LayoutMember *a, const LayoutMember *b) {
+                         return a->offset < b->offset;
+                       });
+      llvm::json::Array holes;
+      int64_t covered = 0, padding = 0;
+      for (const LayoutMember *lm : sorted) {
+        if (lm->offset > covered) {
+          holes.push_back(llvm::json::Object{
+              {"offset", covered}, {"size", lm->offset - covered}});
+          padding += lm->offset - covered;
+        }
+        covered = std::max(covered, lm->offset + lm->size);
+      }
+      if (wc.size > covered) {
+        holes.push_back(llvm::json::Object{{"offset", covered},
+                                           {"size", wc.size - covered},
+                                           {"tail", true}});
+        padding += wc.size - covered;
+      }
+
+      llvm::json::Array warnings;
+      for (const LayoutMember &lm : wc.members) {
+        if (lm.kind.empty() || lm.size == 0)
+          continue;
+        llvm::json::Array with;
+        for (const LayoutMember &other : wc.members)
+          if (&other != &lm && other.size != 0 &&
+              other.offset / line <= lastLine(lm) &&
+              lastLine(other) >= lm.offset / line)
+            with.push_back(other.name);
+        if (!with.empty())
+          warnings.push_back(llvm::json::Object{{"kind", "shared-line"},
+                                                {"member", lm.name},
+                                                {"memberKind", lm.kind},
+                                                {"with", std::move(with)}});
+      }
+      // only objects from an aligned _create keep their lines to
+      // themselves: pool slots are packed back to back, and a class without
+      // _create is allocated by C++ code
+      bool alignedCreate = AlignCreate && !isPooled(wc.name) &&
+                           created.count(wc.name) != 0;
+      if (synchronized && !alignedCreate &&
+          (wc.size % line != 0 || wc.align < line))
+        warnings.push_back(llvm::json::Object{
+            {"kind", "heap-neighbours"},
+            {"member", nullptr},
+            {"memberKind", nullptr},
+            {"with", llvm::json::Array()}});
+      warningCount += warnings.size();
+
+      classes.push_back(llvm::json::Object{
+          {"name", wc.name},
+          {"cxxName", wc.cxxName},
+          {"size", wc.size},
+          {"align", wc.align},
+          {"lines", (wc.size + line - 1) / line},
+          {"padding", padding},
+          {"members", std::move(members)},
+          {"holes", std::move(holes)},
+          {"warnings", std::move(warnings)}});
+    }
+  }
+
+  std::string report;
+  llvm::raw_string_ostream OS(report);
+  OS << llvm::formatv("{0:2}", llvm::json::Value(llvm::json::Object{
+                                   {"cacheLine", line},
+                                   {"alignCreate", AlignCreate.getValue()},
+                                   {"warnings", warningCount},
+                                   {"classes", std::move(classes)}}));
+  writeOutputFile(LayoutReport, OS.str());
+}
+
+// Writes cwrapper.cmake, which builds the wrappers as ThinLTO bitcode with the
+// include paths and definitions of the wrapped sources. -flto=thin is a PUBLIC
+// option, so the C code linking the library is compiled to bitcode as well and
+// the linker can inline the C++ methods into their C callers. It also defines
+// cwrapper_shared, a shared library exporting the C functions alone through
+// cwrapper.map, and binding its own calls at link time.
+void emitCMakeTarget(const CompilationDatabase &db, StringRef source) {
+  std::stringstream includes, definitions, options;
+  for (const CompileCommand &cc : db.getCompileCommands(source)) {
+    for (const string &arg : cc.CommandLine) {
+      StringRef flag(arg);
+      if (flag.consume_front("-I") && !flag.empty()) {
+        SmallString<128> dir(cc.Directory);
+        llvm::sys::path::append(dir, flag);
+        if (llvm::sys::path::is_absolute(flag))
+          dir = flag;
+        llvm::sys::path::remove_dots(dir, true);
+        includes << "\n    \"" << dir.str().str() << "\"";
+      } else if (flag.consume_front("-D"))
+        definitions << "\n    \"" << flag.str() << "\"";
+      else if (flag.startswith("-std="))
+        options << " " << flag.str();
+    }
+  }
+
+  // Every wrapper and C API function starts with a wrapped class name or
+  // "cpp2c_", and C++ symbols are mangled, so the patterns only match them.
+  std::stringstream map;
+  map << "/* Generated by cpp2c, do not edit. */\n"
+         "CPP2C {\n"
+         "  global:\n";
+  for (StringRef className : ClassList)
+    map << "    " << className.str() << "_*;\n";
+  map << "    cpp2c_*;\n"
+         "  local:\n"
+         "    *;\n"
+         "};";
+  writeOutputFile("cwrapper.map", map.str());
+
+  std::stringstream cmake;
+  cmake
+      << "# Generated by cpp2c, do not edit.\n"
+         "#\n"
+         "# include() this file to get the static library \"cwrapper\", built "
+         "as ThinLTO\n"
+         "# bitcode. Targets linking it are compiled with -flto=thin too, so "
+         "the linker\n"
+         "# sees the C callers and the wrapped C++ methods together and "
+         "inlines through\n"
+         "# the wrappers. This needs clang for C and C++ and lld, and the "
+         "library\n"
+         "# implementing the wrapped classes should be built with -flto=thin "
+         "as well.\n"
+         "if(CMAKE_VERSION VERSION_LESS 3.13)\n"
+         "  message(FATAL_ERROR \"cwrapper.cmake requires CMake 3.13\")\n"
+         "endif()\n"
+         "if(NOT TARGET cwrapper)\n"
+         "  foreach(lang C CXX)\n"
+         "    if(CMAKE_${lang}_COMPILER_LOADED AND\n"
+         "       NOT CMAKE_${lang}_COMPILER_ID MATCHES \"Clang\")\n"
+         "      message(WARNING \"cwrapper: ${lang} is not compiled with "
+         "clang, calls through \"\n"
+         "                      \"the wrappers will not be inlined\")\n"
+         "    endif()\n"
+         "  endforeach()\n\n"
+         "  set(CWRAPPER_LINK_LIBRARIES \"\" CACHE STRING\n"
+         "      \"Libraries implementing the classes wrapped by cwrapper\")"
+         "\n\n";
+  // the shards are listed by cwrapper_sources.cmake
+  string sources = "\"${CMAKE_CURRENT_LIST_DIR}/cwrapper.cpp\"";
+  if (ShardByClass || ShardSize) {
+    cmake << "  include("
+             "\"${CMAKE_CURRENT_LIST_DIR}/cwrapper_sources.cmake\")\n";
+    sources = "${CWRAPPER_SOURCES}";
+  }
+  for (const string target : {"cwrapper", "cwrapper_shared"}) {
+    cmake << "  add_library(" << target
+          << (target == "cwrapper" ? " STATIC " : " SHARED ") << sources
+          << ")\n"
+          << "  target_include_directories(" << target << " PUBLIC "
+          << "\"${CMAKE_CURRENT_LIST_DIR}\")\n";
+    if (!includes.str().empty())
+      cmake << "  target_include_directories(" << target << " PRIVATE"
+            << includes.str() << ")\n";
+    if (!definitions.str().empty())
+      cmake << "  target_compile_definitions(" << target << " PRIVATE"
+            << definitions.str() << ")\n";
+    if (!options.str().empty())
+      cmake << "  target_compile_options(" << target << " PRIVATE"
+            << options.str() << ")\n";
+    cmake << "  target_link_libraries(" << target
+          << " PUBLIC ${CWRAPPER_LINK_LIBRARIES})\n";
+  }
+  cmake << "  set_target_properties(cwrapper PROPERTIES "
+           "POSITION_INDEPENDENT_CODE ON)\n"
+           "  target_compile_options(cwrapper PUBLIC -flto=thin)\n"
+           "  target_link_options(cwrapper INTERFACE -flto=thin "
+           "-fuse-ld=lld)\n\n"
+           "  # Only the functions declared CPP2C_API are exported, calls "
+           "inside the\n"
+           "  # library are bound when it is linked, neither through the PLT "
+           "nor\n"
+           "  # interposable, and the dynamic linker has fewer symbols to "
+           "resolve.\n"
+           "  set_target_properties(cwrapper_shared PROPERTIES\n"
+           "      OUTPUT_NAME cwrapper\n"
+           "      C_VISIBILITY_PRESET hidden\n"
+           "      CXX_VISIBILITY_PRESET hidden\n"
+           "      VISIBILITY_INLINES_HIDDEN ON\n"
+           "      LINK_DEPENDS \"${CMAKE_CURRENT_LIST_DIR}/cwrapper.map\")\n"
+           "  target_compile_options(cwrapper_shared PRIVATE "
+           "-fno-semantic-interposition)\n"
+           "  target_link_options(cwrapper_shared PRIVATE -Wl,-Bsymbolic\n"
+           "      \"-Wl,--version-script="
+           "${CMAKE_CURRENT_LIST_DIR}/cwrapper.map\")\n"
+           "endif()\n";
+
+  writeOutputFile("cwrapper.cmake", cmake.str());
+}
+
+/** System headers PCH **/
+// The system headers included from user code are precompiled once into
+// -system-pch, and later runs pass it with -include-pch. Next to the PCH,
+// "<pch>.h" is the prefix header it was built from and "<pch>.json" records
+// the compile flags, the files it read and how long a source took to parse
+// without it.
+
+// the compile command of source without the source itself, sources sharing
+// it can share one PCH
+string compileFlags(const CompilationDatabase &db, StringRef source) {
+  std::stringstream flags;
+  for (const CompileCommand &cc : db.getCompileCommands(source)) {
+    flags << cc.Directory;
+    for (const string &arg : cc.CommandLine)
+      if (arg != cc.Filename)
+        flags << " " << arg;
+  }
+  return hashString(flags.str());
+}
+
+SystemPCHInfo loadSystemPCHInfo() {
+  SystemPCHInfo info;
+  auto buffer = llvm::MemoryBuffer::getFile(SystemPCH + ".json");
+  if (!buffer || !llvm::sys::fs::exists(SystemPCH))
+    return info;
+  llvm::Expected<llvm::json::Value> entry =
+      llvm::json::parse((*buffer)->getBuffer());
+  if (!entry) {
+    llvm::consumeError(entry.takeError());
+    return info;
+  }
+  const llvm::json::Object *obj = entry->getAsObject();
+  if (!obj || !dependenciesUnchanged(obj->getObject("dependencies")))
+    return info;
+
+  info.flags = obj->getString("flags").getValueOr("").str();
+  info.parseSeconds = obj->getNumber("parseSeconds").getValueOr(0);
+  info.usable = !info.flags.empty();
+  return info;
+}
+
+// Precompiles the system headers the parsed sources included, with the
+// compile flags of the first parsed source.
+void buildSystemPCH(const CompilationDatabase &db,
+                    const vector<string> &sources,
+                    const vector<TUResult> &TUResults) {
+  std::set<string> includes;
+  string flagsSource;
+  double parseSeconds = 0;
+  unsigned parsed = 0;
+  for (size_t i = 0; i < sources.size(); i++) {
+    if (TUResults[i].mode != "parsed")
+      continue;
+    if (flagsSource.empty())
+      flagsSource = sources[i];
+    includes.insert(TUResults[i].systemIncludes.begin(),
+                    TUResults[i].systemIncludes.end());
+    parseSeconds += TUResults[i].seconds;
+    parsed++;
+  }
+  if (includes.empty())
+    return;
+
+  string prefix;
+  for (const string &include : includes)
+    prefix += "#include " + include + "\n";
+  string prefixHeader = SystemPCH + ".h";
+  writeOutputFile(prefixHeader, prefix);
+
+  // the prefix header is compiled like the first source was
+  std::vector<CompileCommand> commands = db.getCompileCommands(flagsSource);
+  if (commands.empty())
+    return;
+  vector<string> args;
+  for (const string &arg : llvm::drop_begin(commands.front().CommandLine))
+    if (arg != commands.front().Filename)
+      args.push_back(arg);
+  FixedCompilationDatabase prefixDB(commands.front().Directory, args);
+  ClangTool Tool(prefixDB, {prefixHeader});
+
+  TUResult result;
+  MyFrontendActionFactory<GenerateSystemPCHAction> Factory(result);
+  if (Tool.run(&Factory)) {
+    llvm::errs() << "warning: could not precompile the system headers into '"
+                 << SystemPCH << "'\n";
+    return;
+  }
+
+  result.dependencies.push_back(prefixHeader);
+  writeJSONFile(SystemPCH + ".json",
+                llvm::json::Object{
+                    {"flags", compileFlags(db, flagsSource)},
+                    {"parseSeconds", parseSeconds / parsed},
+                    {"dependencies", hashDependencies(result.dependencies)}});
+}
+
+/** Frontend **/
+// .ast, .pch and .pcm files are deserialized instead of parsed
+bool isASTFile(StringRef path) {
+  StringRef ext = llvm::sys::path::extension(path);
+  return ext == ".ast" || ext == ".pch" || ext == ".pcm";
+}
+
+int loadASTFile(StringRef path, TUResult &result) {
+  IntrusiveRefCntPtr<DiagnosticsEngine> Diags =
+      CompilerInstance::createDiagnostics(new DiagnosticOptions());
+  PCHContainerOperations PCHOps;
+  std::unique_ptr<ASTUnit> Unit = ASTUnit::LoadFromASTFile(
+      path.str(), PCHOps.getRawReader(), ASTUnit::LoadEverything, Diags,
+      FileSystemOptions());
+  if (!Unit) {
+    llvm::errs() << "while loading '" << path << "': not a valid AST file\n";
+    return 1;
+  }
+
+  MyASTConsumer Consumer(result);
+  Consumer.HandleTranslationUnit(Unit->getASTContext());
+  result.dependencies.push_back(path.str());
+  return 0;
+}
+
+// Fills the result of one source, from the cache, an AST file or by running
+// the frontend on it.
+int processSource(const CompilationDatabase &db, StringRef source,
+                  const SystemPCHInfo &pch, TUResult &result) {
+  auto start = std::chrono::steady_clock::now();
+  auto elapsed = [&]() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+  };
+
+  string key;
+  if (!CacheDir.empty()) {
+    SmallString<128> path(source);
+    llvm::sys::fs::make_absolute(path);
+    key = cacheKey(db, path);
+    // nothing this TU depends on changed, skip the frontend
+    if (loadCacheEntry(key, result)) {
+      result.mode = "cached";
+      result.seconds = elapsed();
+      return 0;
+    }
+    result.functions.clear();
+    result.classes.clear();
+    result.records.clear();
+    result.bodyIncludes.clear();
+    result.callbackTypedefs.clear();
+  }
+
+  int ret;
+  if (isASTFile(source)) {
+    result.mode = "AST file";
+    ret = loadASTFile(source, result);
+  } else {
+    IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS =
+        llvm::vfs::createPhysicalFileSystem();
+    ClangTool Tool(db, {source.str()},
+                   std::make_shared<PCHContainerOperations>(), FS);
+    result.mode = "parsed";
+    if (pch.usable && compileFlags(db, source) == pch.flags) {
+      Tool.appendArgumentsAdjuster(getInsertArgumentAdjuster(
+          {"-include-pch", SystemPCH.getValue()}, ArgumentInsertPosition::END));
+      result.mode = "system PCH";
+    }
+    MyFrontendActionFactory<MyFrontendAction> Factory(result);
+    // run the Clang Tool, creating a new FrontendAction
+    ret = Tool.run(&Factory);
+    // the PCH stands for the system headers it was built from
+    if (result.mode == "system PCH")
+      result.dependencies.push_back(SystemPCH);
+  }
+  result.seconds = elapsed();
+
+  if (ret == 0 && !key.empty())
+    storeCacheEntry(key, result);
+  return ret;
+}
+
+// Every source file gets its own ClangTool (and VFS, so that concurrent
+// working directory changes do not interfere) like AllTUsToolExecutor does,
+// but over the given source list rather than over every file of the
+// compilation database, which is empty for a fixed "--" database.
+int parseSources(const CompilationDatabase &db, const vector<string> &sources,
+                 const SystemPCHInfo &pch, vector<TUResult> &TUResults) {
+  std::atomic<int> status(0);
+  llvm::ThreadPool Pool(llvm::hardware_concurrency(Jobs));
+  for (size_t i = 0; i < sources.size(); i++) {
+    Pool.async([&, i]() {
+      if (int ret = processSource(db, sources[i], pch, TUResults[i]))
+        status = ret;
+    });
+  }
+  Pool.wait();
+  return status;
+}
+
+/** API model **/
+// -emit-ir writes what the handlers extracted from every TU, with the
+// options that shaped it, and -from-ir emits the outputs from such a file
+// without running the frontend. Other emitters can read it too: "wrappers"
+// lists the C functions in emission order with their overload number and
+// their position in "units", which hold the wrappers, classes and records of
+// each source. A wrapper has its C++ method, signature, staticness and
+// constness, and every parameter and the return value with their C and C++
+// types and conversion (WrapperParam), so that a backend other than the C
+// one does not parse the C++ body or the C declarations.
+const char *IRFormatVersion = "cpp2c-ir-2";
+
+// the options the frontend used, restored by -from-ir
+llvm::json::Object irOptions() {
+  return llvm::json::Object{
+      {"classes", ClassesToGenrate.getValue()},
+      {"instantiate", Instantiate.getValue()},
+      {"placement", Placement.getValue()},
+      {"pooled", vector<string>(Pooled.begin(), Pooled.end())},
+      {"accurateSignatures", AccurateSignatures.getValue()},
+      {"batch", BatchPattern.getValue()},
+      {"async", AsyncPattern.getValue()},
+      {"exceptionBoundary", ExceptionBoundary.getValue()},
+      {"overheadBench", OverheadBench.getValue()},
+      {"headerFilter", HeaderFilter.getValue()},
+      {"alignCreate", AlignCreate.getValue()},
+      {"cacheLine", static_cast<int64_t>(CacheLineSize)}};
+}
+
+bool restoreIROptions(const llvm::json::Value &v) {
+  string classes, instantiate, batch, async, overheadBench, headerFilter;
+  vector<string> pooled;
+  bool placement, accurateSignatures, exceptionBoundary, alignCreate;
+  int64_t cacheLine;
+  llvm::json::Path::Root root;
+  llvm::json::ObjectMapper O(v, root);
+  if (!O || !O.map("classes", classes) ||
+      !O.map("instantiate", instantiate) || !O.map("placement", placement) ||
+      !O.map("pooled", pooled) ||
+      !O.map("accurateSignatures", accurateSignatures) ||
+      !O.map("batch", batch) || !O.map("async", async) ||
+      !O.map("exceptionBoundary", exceptionBoundary) ||
+      !O.map("overheadBench", overheadBench) ||
+      !O.map("headerFilter", headerFilter) ||
+      !O.map("alignCreate", alignCreate) || !O.map("cacheLine", cacheLine))
+    return false;
+  ClassesToGenrate = classes;
+  Instantiate = instantiate;
+  Placement = placement;
+  Pooled.clear();
+  for (const string &className : pooled)
+    Pooled.push_back(className);
+  AccurateSignatures = accurateSignatures;
+  BatchPattern = batch;
+  AsyncPattern = async;
+  ExceptionBoundary = exceptionBoundary;
+  OverheadBench = overheadBench;
+  HeaderFilter = headerFilter;
+  AlignCreate = alignCreate;
+  CacheLineSize = static_cast<unsigned>(cacheLine);
+  return true;
+}
+
+void writeIR(const vector<TUResult> &TUResults) {
+  llvm::json::Array classes;
+  for (StringRef className : ClassList)
+    classes.push_back(className);
+  // where each wrapper is in units, so that backends need not compute keys
+  std::map<const WrapperFunction *, std::pair<int64_t, int64_t>> positions;
+  for (size_t unit = 0; unit < TUResults.size(); unit++)
+    for (size_t i = 0; i < TUResults[unit].functions.size(); i++)
+      positions[&TUResults[unit].functions[i]] = {unit, i};
+  llvm::json::Array wrappers;
+  for (const NumberedWrapper &nw : numberWrappers(TUResults))
+    wrappers.push_back(llvm::json::Object{{"name", nw.name},
+                                          {"overload", nw.overload},
+                                          {"unit", positions[nw.wf].first},
+                                          {"function", positions[nw.wf].second},
+                                          {"key", nw.wf->key()}});
+  llvm::json::Value ir = llvm::json::Object{{"format", IRFormatVersion},
+                                            {"options", irOptions()},
+                                            {"classes", std::move(classes)},
+                                            {"units", TUResults},
+                                            {"wrappers", std::move(wrappers)}};
+  writeOutputFile(EmitIR, llvm::formatv("{0}", ir).str());
+}
+
+// Restores the options of the IR file at path, and the results of its TUs.
+bool loadIR(StringRef path, vector<TUResult> &TUResults) {
+  auto buffer = llvm::MemoryBuffer::getFile(path);
+  if (!buffer) {
+    llvm::errs() << "while opening '" << path
+                 << "': " << buffer.getError().message() << '\n';
+    return false;
+  }
+  llvm::Expected<llvm::json::Value> ir =
+      llvm::json::parse((*buffer)->getBuffer());
+  if (!ir) {
+    llvm::errs() << "while reading '" << path
+                 << "': " << llvm::toString(ir.takeError()) << '\n';
+    return false;
+  }
+  const llvm::json::Object *obj = ir->getAsObject();
+  llvm::Optional<StringRef> format = obj ? obj->getString("format") : None;
+  if (!format || *format != IRFormatVersion) {
+    llvm::errs() << "'" << path << "' is not a " << IRFormatVersion
+                 << " file, run -emit-ir again\n";
+    return false;
+  }
+  const llvm::json::Value *options = obj->get("options");
+  const llvm::json::Value *units = obj->get("units");
+  llvm::json::Path::Root root;
+  if (!options || !units || !restoreIROptions(*options) ||
+      !fromJSON(*units, TUResults, root)) {
+    llvm::errs() << "while reading '" << path << "': malformed API model\n";
+    return false;
+  }
+  return true;
+}
+
+// cwrapper.h, cwrapper.cpp and the outputs asked for by the options
+void writeOutputs(const CompilationDatabase &db, const vector<string> &sources,
+                  const vector<TUResult> &TUResults) {
+  OutputStreams OS;
+  emitWrappers(OS, TUResults);
+  // the shards of an earlier run, when this one does not shard
+  if (!ShardByClass && !ShardSize) {
+    removeStaleShards({});
+    llvm::sys::fs::remove("cwrapper_sources.cmake");
+  }
+  writeOutputFile("cwrapper.h", OS.headerString);
+  writeOutputFile("cwrapper.cpp", OS.bodyString);
+  if (OverheadRegex)
+    writeOverheadBench(OS);
+  if (EmitCMake && !sources.empty())
+    emitCMakeTarget(db, sources.front());
+  if (!LayoutReport.empty())
+    writeLayoutReport(TUResults);
+  if (!EmitIR.empty())
+    writeIR(TUResults);
+}
+
+/** Watch mode **/
+// -watch keeps an ASTUnit per source. Its preamble, the includes at the top
+// of the source, is precompiled on the first parse and reused by the next
+// ones as long as none of the files it read changed. With -system-pch the
+// preamble is layered on the system headers PCH, so a change to a wrapped
+// header only reparses the user headers. The directories of every
+// file a TU read are watched with inotify (editors often replace a file
+// rather than write to it), and a TU is reparsed when the content of one of
+// its files changed. The outputs are emitted again after every change, and
+// writeOutputFile only rewrites the ones whose content differs.
+class SourceWatcher {
+public:
+  SourceWatcher(const CompilationDatabase &db, const vector<string> &sources,
+                const SystemPCHInfo &pch, vector<TUResult> &results)
+      : DB(db), Sources(sources), PCH(pch), Results(results),
+        Units(sources.size()), Hashes(sources.size()) {}
+
+  ~SourceWatcher() {
+    if (Inotify >= 0)
+      close(Inotify);
+  }
+
+  // only returns on inotify errors
+  int run() {
+    Inotify = inotify_init1(IN_CLOEXEC);
+    if (Inotify < 0) {
+      llvm::errs() << "inotify_init1: " << strerror(errno) << '\n';
+      return 1;
+    }
+
+    // the sources that do not parse yet are watched like the others
+    vector<size_t> all;
+    for (size_t i = 0; i < Sources.size(); i++)
+      all.push_back(i);
+    update(all);
+    llvm::errs() << "cpp2c: watching " << Dirs.size() << " directories\n";
+
+    alignas(struct inotify_event) char buffer[16 * 1024];
+    while (true) {
+      // wait for a change, then for the editor to be done writing
+      std::set<string> changed;
+      struct pollfd pfd = {Inotify, POLLIN, 0};
+      int timeout = -1;
+      while (int ready = poll(&pfd, 1, timeout)) {
+        if (ready < 0 && errno == EINTR)
+          continue;
+        ssize_t n = ready < 0 ? -1 : read(Inotify, buffer, sizeof(buffer));
+        if (n < 0) {
+          llvm::errs() << "inotify: " << strerror(errno) << '\n';
+          return 1;
+        }
+        for (char *p = buffer; p < buffer + n;) {
+          const auto *event = reinterpret_cast<struct inotify_event *>(p);
+          auto dir = Dirs.find(event->wd);
+          if (event->len && dir != Dirs.end()) {
+            SmallString<128> path(dir->second);
+            llvm::sys::path::append(path, event->name);
+            changed.insert(path.str().str());
+          }
+          p += sizeof(struct inotify_event) + event->len;
+        }
+        timeout = 20;
+      }
+
+      // the TUs that read one of the files, if its content changed
+      vector<size_t> stale;
+      for (size_t i = 0; i < Sources.size(); i++)
+        for (const string &path : changed)
+          if (llvm::Optional<StringRef> hash = Hashes[i].getString(path))
+            if (hashFile(path) != *hash) {
+              stale.push_back(i);
+              break;
+            }
+      if (!stale.empty())
+        update(stale);
+    }
+  }
+
+private:
+  // Reparses the given sources and writes the outputs. A source that does
+  // not parse keeps its last wrappers, and is reparsed when one of the files
+  // it read changes.
+  void update(const vector<size_t> &sources) {
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<unsigned> failed(0);
+    {
+      llvm::ThreadPool Pool(llvm::hardware_concurrency(Jobs));
+      for (size_t i : sources)
+        Pool.async([&, i]() {
+          if (!parse(i))
+            failed++;
+        });
+      Pool.wait();
+    }
+    if (failed)
+      llvm::errs() << "cpp2c: " << failed
+                   << " sources did not parse, keeping their last wrappers\n";
+    // new includes may be in new directories
+    for (size_t i : sources)
+      for (const auto &dep : Hashes[i])
+        watch(llvm::sys::path::parent_path(dep.first));
+
+    writeOutputs(DB, Sources, Results);
+    llvm::errs() << llvm::format(
+        "cpp2c: %zu of %zu sources reparsed in %.0f ms\n", sources.size(),
+        Sources.size(),
+        std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start)
+            .count());
+  }
+
+  bool parse(size_t i) {
+    auto start = std::chrono::steady_clock::now();
+    StringRef source = Sources[i];
+    if (!Units[i]) {
+      vector<CompileCommand> commands = DB.getCompileCommands(source);
+      if (commands.empty()) {
+        llvm::errs() << "no compile command for '" << source << "'\n";
+        return false;
+      }
+      // the adjustments ClangTool makes
+      CommandLineArguments args = commands.front().CommandLine;
+      for (const ArgumentsAdjuster &adjuster :
+           {getClangStripOutputAdjuster(), getClangSyntaxOnlyAdjuster(),
+            getClangStripDependencyFileAdjuster()})
+        args = adjuster(args, source);
+      if (usesPCH(source))
+        args = getInsertArgumentAdjuster({"-include-pch", SystemPCH.getValue()},
+                                         ArgumentInsertPosition::END)(args,
+                                                                      source);
+      vector<const char *> argv;
+      for (const string &arg : args)
+        argv.push_back(arg.c_str());
+
+      IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS =
+          llvm::vfs::createPhysicalFileSystem();
+      FS->setCurrentWorkingDirectory(commands.front().Directory);
+      static int StaticSymbol;
+      Units[i].reset(ASTUnit::LoadFromCommandLine(
+          argv.data(), argv.data() + argv.size(), PCHOps,
+          CompilerInstance::createDiagnostics(new DiagnosticOptions()),
+          CompilerInvocation::GetResourcesPath("cpp2c", &StaticSymbol),
+          /*OnlyLocalDecls=*/false, CaptureDiagsKind::None, None,
+          /*RemappedFilesKeepOriginalName=*/true,
+          /*PrecompilePreambleAfterNParses=*/1, TU_Complete,
+          /*CacheCodeCompletionResults=*/false,
+          /*IncludeBriefCommentsInCodeCompletion=*/false,
+          /*AllowPCHWithCompilerErrors=*/false, SkipFunctionBodiesScope::None,
+          /*SingleFileParse=*/false, /*UserFilesAreVolatile=*/true,
+          /*ForSerialization=*/false,
+          /*RetainExcludedConditionalBlocks=*/false, None, nullptr, FS));
+      if (!Units[i]) {
+        // the source itself is watched until it parses
+        Hashes[i] = hashDependencies({source.str()});
+        return false;
+      }
+    } else if (Units[i]->Reparse(PCHOps)) {
+      return false;
+    }
+    ASTUnit &Unit = *Units[i];
+    vector<string> dependencies = unitDependencies(Unit);
+    if (usesPCH(source))
+      dependencies.push_back(SystemPCH);
+    // a source with errors is reparsed when they may be fixed
+    Hashes[i] = hashDependencies(dependencies);
+    if (Unit.getDiagnostics().hasErrorOccurred())
+      return false;
+
+    TUResult result;
+    MyASTConsumer Consumer(result);
+    if (Unit.hasSema())
+      Consumer.InitializeSema(Unit.getSema());
+    Consumer.HandleTranslationUnit(Unit.getASTContext());
+    Consumer.ForgetSema();
+
+    result.dependencies = std::move(dependencies);
+    result.mode = usesPCH(source) ? "watched, system PCH" : "watched";
+    result.seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    Results[i] = std::move(result);
+    return true;
+  }
+
+  // the files of the TU, those read through the preamble and the PCH
+  // included
+  static vector<string> unitDependencies(ASTUnit &Unit) {
+    vector<string> dependencies;
+    const SourceManager &SM = Unit.getSourceManager();
+    for (unsigned id = 0; id < SM.local_sloc_entry_size(); id++) {
+      const SrcMgr::SLocEntry &entry = SM.getLocalSLocEntry(id);
+      if (entry.isFile())
+        if (const FileEntry *file = entry.getFile().getContentCache().OrigEntry)
+          dependencies.push_back(file->getName().str());
+    }
+    if (IntrusiveRefCntPtr<ASTReader> reader = Unit.getASTReader())
+      for (serialization::ModuleFile &module : reader->getModuleManager())
+        reader->visitInputFiles(
+            module, /*IncludeSystem=*/true, /*Complain=*/false,
+            [&](const serialization::InputFile &input, bool isSystem) {
+              if (const FileEntry *file = input.getFile())
+                dependencies.push_back(file->getName().str());
+            });
+    return dependencies;
+  }
+
+  // whether the PCH was built with the compile flags of source
+  bool usesPCH(StringRef source) const {
+    return PCH.usable && compileFlags(DB, source) == PCH.flags;
+  }
+
+  void watch(StringRef dir) {
+    if (!WatchedDirs.insert(dir).second)
+      return;
+    int wd = inotify_add_watch(Inotify, dir.str().c_str(),
+                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE |
+                                   IN_DELETE);
+    if (wd < 0)
+      llvm::errs() << "warning: cannot watch '" << dir
+                   << "': " << strerror(errno) << '\n';
+    else
+      Dirs[wd] = dir.str();
+  }
+
+  const CompilationDatabase &DB;
+  const vector<string> &Sources;
+  const SystemPCHInfo &PCH;
+  vector<TUResult> &Results;
+  vector<std::unique_ptr<ASTUnit>> Units;
+  vector<llvm::json::Object> Hashes; // of the files of each TU
+  std::shared_ptr<PCHContainerOperations> PCHOps =
+      std::make_shared<PCHContainerOperations>();
+  int Inotify = -1;
+  std::map<int, string> Dirs; // by watch descriptor
+  llvm::StringSet<> WatchedDirs;
+};
+
+void printTiming(const vector<string> &sources,
+                 const vector<TUResult> &TUResults, const SystemPCHInfo &pch) {
+  double total = 0, saved = 0;
+  unsigned withPCH = 0;
+  llvm::errs() << "===-- cpp2c timing --===\n";
+  for (size_t i = 0; i < sources.size(); i++) {
+    const TUResult &result = TUResults[i];
+    llvm::errs() << llvm::format("%10.3fs  %-12s %s\n", result.seconds,
+                                 result.mode.c_str(), sources[i].c_str());
+    total += result.seconds;
+    if (result.mode == "system PCH") {
+      saved += pch.parseSeconds - result.seconds;
+      withPCH++;
+    }
+  }
+  llvm::errs() << llvm::format("%10.3fs  total for %zu sources\n", total,
+                               sources.size());
+  if (withPCH)
+    llvm::errs() << llvm::format(
+        "%10.3fs  saved by the system PCH on %u sources (%.3fs per source "
+        "without it)\n",
+        saved, withPCH, pch.parseSeconds);
+}
+
+// Sets up what the generator options describe: the wrapped classes of
+// -classes and -instantiate, which -pooled must name, the patterns of
+// -batch, -async, -header-filter and -overhead-bench, and checks
+// -cache-line. Prints what is invalid.
+bool applyGeneratorOptions() {
+  SmallVector<StringRef, 16> classes;
+  llvm::SplitString(ClassesToGenrate, classes, " ");
+  for (StringRef className : classes)
+    addWrappedClass(className);
+
+  // -instantiate: Name<Args> entries, wrapped like the classes of -classes
+  // under their C name
+  if (!Instantiate.empty()) {
+    for (const string &spelling : splitTopLevel(Instantiate)) {
+      StringRef entry(spelling);
+      size_t open = entry.find('<');
+      if (open == StringRef::npos || open == 0 || !entry.endswith(">")) {
+        llvm::errs() << "invalid -instantiate entry '" << spelling
+                     << "', expected Template<Args>\n";
+        return false;
+      }
+      Instantiation inst;
+      inst.spelling = spelling;
+      inst.templateName = entry.substr(0, open).trim().str();
+      inst.args = splitTopLevel(entry.slice(open + 1, entry.size() - 1));
+      inst.cName = cIdentifier(entry);
+      Instantiations.push_back(std::move(inst));
+    }
+    // the names are referenced by ClassList, Instantiations does not grow
+    for (const Instantiation &inst : Instantiations)
+      addWrappedClass(inst.cName);
+  }
+
+  for (const string &className : Pooled)
+    if (!isWrappedClass(className)) {
+      llvm::errs() << "-pooled class '" << className
+                   << "' is not wrapped, list it in -classes\n";
+      return false;
+    }
+
+  if (!BatchPattern.empty()) {
+    BatchRegex = std::make_unique<llvm::Regex>("^(" + BatchPattern + ")$");
+    string error;
+    if (!BatchRegex->isValid(error)) {
+      llvm::errs() << "invalid -batch pattern '" << BatchPattern
+                   << "': " << error << '\n';
+      return false;
+    }
+  }
+
+  if (!AsyncPattern.empty()) {
+    AsyncRegex = std::make_unique<llvm::Regex>("^(" + AsyncPattern + ")$");
+    string error;
+    if (!AsyncRegex->isValid(error)) {
+      llvm::errs() << "invalid -async pattern '" << AsyncPattern
+                   << "': " << error << '\n';
+      return false;
+    }
+  }
+
+  if (!HeaderFilter.empty()) {
+    HeaderRegex = std::make_unique<llvm::Regex>(HeaderFilter);
+    string error;
+    if (!HeaderRegex->isValid(error)) {
+      llvm::errs() << "invalid -header-filter pattern '" << HeaderFilter
+                   << "': " << error << '\n';
+      return false;
+    }
+  }
+
+  if (!OverheadBench.empty()) {
+    OverheadRegex =
+        std::make_unique<llvm::Regex>("^(" + OverheadBench + ")$");
+    string error;
+    if (!OverheadRegex->isValid(error)) {
+      llvm::errs() << "invalid -overhead-bench pattern '" << OverheadBench
+                   << "': " << error << '\n';
+      return false;
+    }
+  }
+
+  // the alignment of posix_memalign in _create
+  if (!llvm::isPowerOf2_32(CacheLineSize) || CacheLineSize < sizeof(void *)) {
+    llvm::errs() << "invalid -cache-line " << CacheLineSize
+                 << ", expected a power of two of at least " << sizeof(void *)
+                 << '\n';
+    return false;
+  }
+  return true;
+}
+
+int cpp2cMain(int argc, const char **argv) {
+  // parse the command-line args passed to your code
+  // no source is needed with -from-ir
+  CommonOptionsParser op(argc, argv, CPP2CCategory, cl::ZeroOrMore);
+  const vector<string> &sources = op.getSourcePathList();
+
+  // -from-ir: the wrappers of an earlier run, and the options it ran with,
+  // which applyGeneratorOptions sets up as they were
+  vector<TUResult> irResults;
+  if (!FromIR.empty()) {
+    if (!loadIR(FromIR, irResults))
+      exit(1);
+  } else if (sources.empty()) {
+    llvm::errs() << "no source to wrap, give one or -from-ir\n";
+    exit(1);
+  }
+
+  if (!applyGeneratorOptions())
+    exit(1);
+
+  if (!FromIR.empty()) {
+    // without sources the options parser leaves no compilation database
+    writeOutputs(FixedCompilationDatabase(".", {}), {}, irResults);
+    return 0;
+  }
+
+  if (!CacheDir.empty()) {
+    if (std::error_code EC = llvm::sys::fs::create_directories(CacheDir)) {
+      llvm::errs() << "while creating '" << CacheDir << "': " << EC.message()
+                   << '\n';
+      exit(1);
+    }
+  }
+
+  SystemPCHInfo pch;
+  if (!SystemPCH.empty())
+    pch = loadSystemPCHInfo();
+
+  if (Watch) {
+    for (const string &source : sources)
+      if (isASTFile(source)) {
+        llvm::errs() << "-watch cannot reparse the AST file '" << source
+                     << "'\n";
+        exit(1);
+      }
+    vector<TUResult> TUResults(sources.size());
+    // the watched units are layered on the PCH, which needs a first parse
+    // to know the system headers
+    if (!SystemPCH.empty() && !pch.usable) {
+      parseSources(op.getCompilations(), sources, pch, TUResults);
+      buildSystemPCH(op.getCompilations(), sources, TUResults);
+      pch = loadSystemPCHInfo();
+    }
+    return SourceWatcher(op.getCompilations(), sources, pch, TUResults).run();
+  }
+
+  vector<TUResult> TUResults(sources.size());
+  int status = parseSources(op.getCompilations(), sources, pch, TUResults);
+
+  if (!SystemPCH.empty() && !pch.usable)
+    buildSystemPCH(op.getCompilations(), sources, TUResults);
+
+  if (PrintTiming)
+    printTiming(sources, TUResults, pch);
 
-  llvm::SplitString(ClassesToGenrate, ClassList, " ");
-  // run the Clang Tool, creating a new FrontendAction
-  return Tool.run(newFrontendActionFactory<MyFrontendAction>().get());
+  writeOutputs(op.getCompilations(), sources, TUResults);
+  return status;
 }
@@ -0,0 +1,182 @@
+// The generator of cpp2c, as a library: cpp2c and cpp2c_bench both link it.
+#ifndef CPP2C_H
+#define CPP2C_H
+
+#include <clang/Tooling/CompilationDatabase.h>
+#include <cstdint>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Support/raw_ostream.h>
+#include <string>
+#include <vector>
+
+/** A parameter of a C wrapper and how the wrapper converts it. conversion is
+ *   none          passed as it is
+ *   self          the object, or selfs of a _batch wrapper
+ *   handle        W<Class>* cast to the C++ pointer
+ *   handle-deref  W<Class>* cast and dereferenced, for references and values
+ *   mirror        C struct copied into the C++ record of the same layout
+ *   data, length  elements and size a container or view is built from
+ *   callback, context
+ *                 function pointer and context adapted to a std::function
+ *   result-storage
+ *                 <Record>_sizeof bytes the returned record is moved into
+ *   out-buffer, out-capacity, out-length
+ *                 caller buffer a returned container is copied to, or the
+ *                 size of a returned view
+ *   storage       where _init constructs the object
+ *   count, results, async-result, user-data, error
+ *                 of the _batch, _submit and _err variants
+ * cxxType is the C++ parameter or return value it stands for, if any. **/
+struct WrapperParam {
+  std::string name;
+  std::string cType;
+  std::string cxxType;
+  std::string conversion;
+
+  std::string declaration() const { return cType + " " + name; }
+};
+
+/** A C function generated for one public method, before overload numbering.
+ * Each translation unit fills its own list, and the lists are merged in
+ * source-list order once every TU has been parsed. **/
+struct WrapperFunction {
+  // declaration location, identifies the method across TUs
+  std::string location;
+  std::string className;
+  std::string methodName;   // "_create", "_destroy" or "_" + method name
+  std::string cxxMethod;    // "Connection::recv"
+  std::string cxxSignature; // "ssize_t (void *, size_t, int)"
+  bool isStatic = false;
+  bool isConst = false;
+  std::string returnType;
+  // C++ return type and how it is returned: none, handle, address (a
+  // reference as a handle), mirror, result-storage, view (the data, the
+  // size in an out-length) or buffer (copied to an out-buffer, its size
+  // returned)
+  std::string cxxReturnType;
+  std::string returnConversion = "none";
+  std::vector<WrapperParam> params;
+  std::vector<std::string> attributes; // GNU attributes of the prototype
+  std::string body; // C++ statements, what a C backend needs alone
+  // -overhead-bench: the default-constructed object, empty for static
+  // methods, the direct call on it and the arguments of the wrapper
+  std::string benchObject;
+  std::string benchDirect; // "object.getFd()", empty if not timed
+  std::string benchArgs;   // "self, 0"
+  // the method returns a field of its class: its offset in bytes, and the
+  // arguments checking it, "__builtin_offsetof(Connection, fd), 8,
+  // decltype(Connection::fd), int"
+  int64_t fieldOffset = -1;
+  std::string fieldCheck;
+  bool async = false; // a _submit wrapper, which needs the async runtime
+
+  // "WConnection* self, int fd"
+  std::string paramList() const {
+    std::string list;
+    for (const WrapperParam &param : params)
+      list += (list.empty() ? "" : ", ") + param.declaration();
+    return list;
+  }
+
+  std::string key() const {
+    return location + "#" + className + methodName + "(" + paramList() + ")";
+  }
+};
+
+/** A field, base or vtable pointer of a class and the bytes it occupies **/
+struct LayoutMember {
+  std::string name; // field name, "<base Name>" or "<vptr>"
+  std::string type;
+  int64_t offset = 0;
+  int64_t size = 0;
+  std::string kind; // "atomic", "lock", or empty for other data
+};
+
+/** Layout of a wrapped class, or of a class returned by value, as computed
+ * by the C++ compiler **/
+struct WrapperClass {
+  std::string name;
+  std::string cxxName; // qualified name
+  int64_t size = 0;
+  int64_t align = 0;
+  bool byValue = false; // returned by value into caller-provided storage
+  std::vector<LayoutMember> members; // in declaration order, for -layout-report
+};
+
+/** C struct with the layout of a trivially copyable C++ record, passed and
+ * returned by value instead of through a handle **/
+struct MirroredRecord {
+  std::string name;       // "W" + cRecordName()
+  std::string definition; // C definition for the header
+  // static_asserts of the body against the C++ layout
+  std::vector<std::string> checks;
+};
+
+/** Everything one translation unit produced **/
+struct TUResult {
+  std::vector<WrapperFunction> functions;
+  std::vector<WrapperClass> classes; // the wrapped classes defined in the TU
+  // nested records come before their users
+  std::vector<MirroredRecord> records;
+  // standard headers the wrapper bodies use
+  std::vector<std::string> bodyIncludes;
+  // C function pointer type per signature
+  std::vector<std::string> callbackTypedefs;
+  // every file the TU read, main file included
+  std::vector<std::string> dependencies;
+  // "<header>" included from non-system code
+  std::vector<std::string> systemIncludes;
+  std::string mode; // how the AST was obtained, for -print-timing
+  double seconds = 0;
+  double matchSeconds = 0; // finding and matching the methods, part of seconds
+};
+
+/** The generated header and body **/
+struct OutputStreams {
+  std::string headerString;
+  std::string bodyString;
+  std::string benchString; // the timed calls of cwrapper_bench.cpp
+
+  llvm::raw_string_ostream HeaderOS;
+  llvm::raw_string_ostream BodyOS;
+  llvm::raw_string_ostream BenchOS;
+
+  OutputStreams()
+      : HeaderOS(headerString), BodyOS(bodyString), BenchOS(benchString){};
+};
+
+/** What a run learned about the system headers PCH of -system-pch **/
+struct SystemPCHInfo {
+  bool usable = false;
+  std::string flags;
+  double parseSeconds = 0; // average per source before the PCH existed
+};
+
+/** Classes to be mapped to C **/
+extern llvm::SmallVector<llvm::StringRef, 16> ClassList;
+extern llvm::StringSet<> ClassSet; // ClassList, hashed for lookups
+
+void addWrappedClass(llvm::StringRef className);
+
+// options that change the generated wrappers, part of every cache key
+std::string generatorOptions();
+
+// Sets up the wrapped classes and patterns the options name, once they are
+// parsed. Returns false, after printing why, when one is invalid.
+bool applyGeneratorOptions();
+
+// Fills the result of one source, from the cache, an AST file or by running
+// the frontend on it.
+int processSource(const clang::tooling::CompilationDatabase &db,
+                  llvm::StringRef source, const SystemPCHInfo &pch,
+                  TUResult &result);
+
+// Merge the per-TU results into one header/body pair.
+void emitWrappers(OutputStreams &OS, const std::vector<TUResult> &TUResults);
+
+// the cpp2c command line tool
+int cpp2cMain(int argc, const char **argv);
+
+#endif
@@ -0,0 +1,215 @@
+// Benchmark of the generator itself. For every size, a header declaring that
+// many classes with overloaded methods over the parameter kinds cpp2c maps is
+// generated, then run through the same pipeline as cpp2c: MyFrontendAction on
+// a ClangTool, then emitWrappers into OutputStreams. Each size runs in its own
+// process so that its peak RSS is not the one of a larger size, and prints one
+// JSON object per line:
+//   {"classes":1000,"methods":8,"wrappers":...,"generate_seconds":...,
+//    "parse_seconds":...,"match_seconds":...,"emit_seconds":...,
+//    "wall_seconds":...,"peak_rss_kb":...,"output_bytes":...,"options":...}
+// The generator options of cpp2c (-accurate-signatures, -batch, ...) apply.
+#include "../CPP2C.h"
+
+#include <chrono>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/Path.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace clang::tooling;
+using namespace llvm;
+using std::string;
+using std::vector;
+
+static cl::OptionCategory BenchCategory("cpp2c_bench options");
+
+static cl::list<unsigned>
+    Sizes("sizes",
+          cl::desc("Numbers of classes to generate, 10,100,1000,10000 by "
+                   "default"),
+          cl::CommaSeparated, cl::cat(BenchCategory));
+
+static cl::opt<unsigned>
+    Methods("methods",
+            cl::desc("Methods per class, overloaded in groups of four"),
+            cl::init(8), cl::cat(BenchCategory));
+
+static cl::opt<std::string>
+    CorpusDir("corpus-dir",
+              cl::desc("Directory of the generated sources, a temporary one "
+                       "removed afterwards by default"),
+              cl::cat(BenchCategory));
+
+// The methods cycle through scalars, C strings, pointers and references to
+// other wrapped classes, mirrored records and const methods.
+static void writeMethod(llvm::raw_ostream &OS, unsigned cls, unsigned classes,
+                        unsigned method) {
+  string other = "Bench" + std::to_string((cls + 1) % classes);
+  string name = "method" + std::to_string(method / 4);
+  switch (method % 7) {
+  case 0:
+    OS << "  int " << name << "(int a);\n";
+    break;
+  case 1:
+    OS << "  double " << name << "(double a, int b);\n";
+    break;
+  case 2:
+    OS << "  void " << name << "(const char *s, unsigned long n);\n";
+    break;
+  case 3:
+    OS << "  bool " << name << "(" << other << " *o);\n";
+    break;
+  case 4:
+    OS << "  " << other << " *" << name << "(" << other << " &o, long w);\n";
+    break;
+  case 5:
+    OS << "  BenchPoint " << name << "(BenchPoint p, float f);\n";
+    break;
+  case 6:
+    OS << "  int " << name << "(const " << other << " &o) const;\n";
+    break;
+  }
+}
+
+// bench.h with the classes, and bench.cpp including it
+static void writeCorpus(StringRef dir, unsigned classes, string &source) {
+  SmallString<128> header(dir), cpp(dir);
+  llvm::sys::path::append(header, "bench.h");
+  llvm::sys::path::append(cpp, "bench.cpp");
+
+  std::error_code EC;
+  llvm::raw_fd_ostream HOS(header, EC, llvm::sys::fs::OF_Text);
+  if (EC) {
+    llvm::errs() << "while opening '" << header << "': " << EC.message()
+                 << '\n';
+    exit(1);
+  }
+  HOS << "#pragma once\n"
+         "struct BenchPoint {\n  int x, y;\n};\n";
+  for (unsigned i = 0; i < classes; i++)
+    HOS << "class Bench" << i << ";\n";
+  for (unsigned i = 0; i < classes; i++) {
+    string name = "Bench" + std::to_string(i);
+    HOS << "class " << name << " {\npublic:\n"
+        << "  " << name << "();\n"
+        << "  " << name << "(int seed);\n"
+        << "  ~" << name << "();\n";
+    for (unsigned j = 0; j < Methods; j++)
+      writeMethod(HOS, i, classes, j);
+    HOS << "  static int count();\n\nprivate:\n  int state;\n};\n";
+  }
+
+  llvm::raw_fd_ostream SOS(cpp, EC, llvm::sys::fs::OF_Text);
+  if (EC) {
+    llvm::errs() << "while opening '" << cpp << "': " << EC.message() << '\n';
+    exit(1);
+  }
+  SOS << "#include \"bench.h\"\n";
+  source = cpp.str().str();
+}
+
+static llvm::json::Object runSize(unsigned classes, StringRef dir) {
+  using Clock = std::chrono::steady_clock;
+  auto since = [](Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+  };
+  auto start = Clock::now();
+
+  string source;
+  writeCorpus(dir, classes, source);
+  double generateSeconds = since(start);
+
+  // the names ClassList refers to, next to those of -classes and
+  // -instantiate
+  vector<string> names;
+  for (unsigned i = 0; i < classes; i++)
+    names.push_back("Bench" + std::to_string(i));
+  for (const string &name : names)
+    addWrappedClass(name);
+
+  vector<string> args{"-std=c++11"};
+  FixedCompilationDatabase db(dir, args);
+  vector<TUResult> TUResults(1);
+  int status = processSource(db, source, SystemPCHInfo(), TUResults[0]);
+
+  auto emit = Clock::now();
+  OutputStreams OS;
+  emitWrappers(OS, TUResults);
+  OS.HeaderOS.flush();
+  OS.BodyOS.flush();
+  double emitSeconds = since(emit);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  const TUResult &result = TUResults[0];
+  return llvm::json::Object{
+      {"classes", classes},
+      {"methods", Methods.getValue()},
+      {"status", status},
+      {"wrappers", static_cast<int64_t>(result.functions.size())},
+      {"generate_seconds", generateSeconds},
+      {"parse_seconds", result.seconds - result.matchSeconds},
+      {"match_seconds", result.matchSeconds},
+      {"emit_seconds", emitSeconds},
+      {"wall_seconds", since(start)},
+      {"peak_rss_kb", static_cast<int64_t>(usage.ru_maxrss)},
+      {"output_bytes",
+       static_cast<int64_t>(OS.headerString.size() + OS.bodyString.size())},
+      {"options", generatorOptions()}};
+}
+
+int main(int argc, const char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "cpp2c benchmark\n");
+  if (!applyGeneratorOptions())
+    return 1;
+  vector<unsigned> sizes(Sizes.begin(), Sizes.end());
+  if (sizes.empty())
+    sizes = {10, 100, 1000, 10000};
+
+  SmallString<128> dir(CorpusDir);
+  if (dir.empty()) {
+    if (std::error_code EC =
+            llvm::sys::fs::createUniqueDirectory("cpp2c-bench", dir)) {
+      llvm::errs() << "while creating the corpus directory: " << EC.message()
+                   << '\n';
+      return 1;
+    }
+  } else if (std::error_code EC = llvm::sys::fs::create_directories(dir)) {
+    llvm::errs() << "while creating '" << dir << "': " << EC.message() << '\n';
+    return 1;
+  }
+
+  int status = 0;
+  for (unsigned classes : sizes) {
+    if (classes == 0)
+      continue;
+    llvm::outs().flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+      llvm::errs() << "fork failed\n";
+      return 1;
+    }
+    if (pid == 0) {
+      llvm::json::Object result = runSize(classes, dir);
+      int ret = *result.getInteger("status");
+      llvm::outs() << llvm::json::Value(std::move(result)) << "\n";
+      llvm::outs().flush();
+      _exit(ret);
+    }
+    int childStatus;
+    if (waitpid(pid, &childStatus, 0) < 0 || !WIFEXITED(childStatus) ||
+        WEXITSTATUS(childStatus) != 0) {
+      llvm::errs() << "benchmark of " << classes << " classes failed\n";
+      status = 1;
+    }
+  }
+
+  if (CorpusDir.empty())
+    llvm::sys::fs::remove_directories(dir);
+  return status;
+}
@@ -0,0 +1,4 @@
+// Driver of cpp2c, the generator is in the cpp2c_generator library
+#include "CPP2C.h"
+
+int main(int argc, const char **argv) { return cpp2cMain(argc, argv); }
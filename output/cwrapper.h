@@ -1,5 +1,5 @@
 #ifndef UTHREADS_CWRAPPER_H
-#define UTHREADS_CWRAPPER_H_
+#define UTHREADS_CWRAPPER_H
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -98,5 +98,5 @@ int Connection_getFd(WConnection* self);
 #ifdef __cplusplus
 }
 #endif
-#endif /* UTHREADS_CWRAPPER_H_ */
+#endif /* UTHREADS_CWRAPPER_H */
 
@@ -0,0 +1,36 @@
+# Generates the -async wrappers of the Counter of
+# test/async/include/generic/basics.h, builds stress.c against them and runs
+# it.
+#   cmake -DCPP2C=<cpp2c> -DSOURCE_DIR=<test/async> -DWORK_DIR=<dir>
+#         -P check_async.cmake
+foreach(var CPP2C SOURCE_DIR WORK_DIR)
+  if(NOT DEFINED ${var})
+    message(FATAL_ERROR "check_async.cmake: ${var} is not set")
+  endif()
+endforeach()
+
+function(run)
+  execute_process(COMMAND ${ARGN} RESULT_VARIABLE status)
+  if(status)
+    message(FATAL_ERROR "'${ARGN}' failed: ${status}")
+  endif()
+endfunction()
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}/output")
+
+execute_process(
+  COMMAND "${CPP2C}" -classes=Counter "-async=Counter::(add|stopFromWorker)"
+          "${SOURCE_DIR}/counter.cpp" --
+          -x c++ -std=c++11 "-I${SOURCE_DIR}/include"
+  WORKING_DIRECTORY "${WORK_DIR}/output"
+  RESULT_VARIABLE status)
+if(status)
+  message(FATAL_ERROR "cpp2c failed: ${status}")
+endif()
+
+run("${CMAKE_COMMAND}" -S "${SOURCE_DIR}" -B "${WORK_DIR}/build"
+    -DCMAKE_BUILD_TYPE=RelWithDebInfo
+    "-DCPP2C_OUTPUT=${WORK_DIR}/output")
+run("${CMAKE_COMMAND}" --build "${WORK_DIR}/build" --target stress)
+run("${WORK_DIR}/build/stress")
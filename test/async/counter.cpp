@@ -0,0 +1,21 @@
+#include "generic/basics.h"
+
+#include <mutex>
+
+static std::mutex lock;
+
+Counter::Counter() : count(0) {}
+
+Counter::~Counter() {}
+
+void Counter::add(int n) {
+  std::lock_guard<std::mutex> guard(lock);
+  count += n;
+}
+
+long Counter::value() {
+  std::lock_guard<std::mutex> guard(lock);
+  return count;
+}
+
+int Counter::stopFromWorker() { return cpp2c_async_stop(); }
@@ -0,0 +1,17 @@
+// Stands for the uThreads headers that cwrapper.cpp includes
+#pragma once
+
+extern "C" int cpp2c_async_stop(void);
+
+class Counter {
+public:
+  Counter();
+  ~Counter();
+  void add(int n);
+  long value();
+  // run by a worker, where the runtime must refuse to stop
+  int stopFromWorker();
+
+private:
+  long count;
+};
@@ -0,0 +1,103 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "cwrapper.h"
+
+// Counter_add is submitted by several threads, and its completions polled,
+// while the runtime is stopped under them. Every accepted call must have
+// run once stop returns, with 0, 1 or 2 workers and a thread joining as a
+// worker, and stopping from a worker must be refused.
+enum { Submitters = 4, Rounds = 60 };
+
+static WCounter *counter;
+static atomic_long accepted;
+static atomic_int done;
+
+static void *submit(void *arg) {
+  (void)arg;
+  while (!atomic_load(&done))
+    if (Counter_add_submit(counter, 1, NULL) == 0)
+      atomic_fetch_add(&accepted, 1);
+  return NULL;
+}
+
+static void *poll_completions(void *arg) {
+  (void)arg;
+  cpp2c_completion completions[64];
+  while (!atomic_load(&done)) {
+    cpp2c_async_fd();
+    cpp2c_async_poll(completions, 64);
+  }
+  return NULL;
+}
+
+static void *join_workers(void *arg) {
+  (void)arg;
+  cpp2c_async_worker();
+  return NULL;
+}
+
+static int run(int round) {
+  unsigned workers = round % 3;
+  counter = Counter_create();
+  atomic_store(&accepted, 0);
+  atomic_store(&done, 0);
+  if (cpp2c_async_start(workers, 64) != 0) {
+    fprintf(stderr, "round %d: cpp2c_async_start failed\n", round);
+    return 1;
+  }
+
+  int fromWorker = 0;
+  Counter_stopFromWorker_submit(counter, &fromWorker, NULL);
+
+  pthread_t submitters[Submitters], poller, worker;
+  for (int i = 0; i < Submitters; i++)
+    pthread_create(&submitters[i], NULL, submit, NULL);
+  pthread_create(&poller, NULL, poll_completions, NULL);
+  if (round % 2)
+    pthread_create(&worker, NULL, join_workers, NULL);
+
+  struct timespec pause = {0, 2000000};
+  nanosleep(&pause, NULL);
+  int stopped = cpp2c_async_stop();
+  atomic_store(&done, 1);
+  for (int i = 0; i < Submitters; i++)
+    pthread_join(submitters[i], NULL);
+  pthread_join(poller, NULL);
+  if (round % 2)
+    pthread_join(worker, NULL);
+
+  int status = 0;
+  long ran = Counter_value(counter);
+  if (stopped != 0) {
+    fprintf(stderr, "round %d: cpp2c_async_stop returned %d\n", round,
+            stopped);
+    status = 1;
+  }
+  if (fromWorker != -1) {
+    fprintf(stderr, "round %d: stopping from a worker returned %d\n", round,
+            fromWorker);
+    status = 1;
+  }
+  if (ran != atomic_load(&accepted)) {
+    fprintf(stderr, "round %d, %u workers: %ld calls accepted, %ld ran\n",
+            round, workers, atomic_load(&accepted), ran);
+    status = 1;
+  }
+  if (Counter_add_submit(counter, 1, NULL) != -1) {
+    fprintf(stderr, "round %d: a call was accepted after stop\n", round);
+    status = 1;
+  }
+  Counter_destroy(counter);
+  return status;
+}
+
+int main(void) {
+  for (int round = 0; round < Rounds; round++)
+    if (run(round))
+      return 1;
+  printf("%d rounds of concurrent submit and stop\n", Rounds);
+  return 0;
+}
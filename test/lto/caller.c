@@ -0,0 +1,14 @@
+#include <stdio.h>
+
+#include "cwrapper.h"
+
+int main(int argc, char **argv) {
+  (void)argv;
+  WSemaphore *s = Semaphore_create();
+  // the hot call path, Semaphore_V should be inlined down to the increment
+  for (int i = 0; i < argc * 1000; i++)
+    Semaphore_V(s);
+  printf("%d\n", Semaphore_value(s));
+  Semaphore_destroy(s);
+  return 0;
+}
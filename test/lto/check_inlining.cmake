@@ -0,0 +1,53 @@
+# Generates the wrappers of test/lto/include/generic/basics.h with
+# -emit-cmake, builds caller.c against the cwrapper target with clang and lld,
+# and fails if the binary still calls Semaphore_V.
+#   cmake -DCPP2C=<cpp2c> -DSOURCE_DIR=<test/lto> -DWORK_DIR=<dir>
+#         -P check_inlining.cmake
+foreach(var CPP2C SOURCE_DIR WORK_DIR)
+  if(NOT DEFINED ${var})
+    message(FATAL_ERROR "check_inlining.cmake: ${var} is not set")
+  endif()
+endforeach()
+
+function(run)
+  execute_process(COMMAND ${ARGN} RESULT_VARIABLE status)
+  if(status)
+    message(FATAL_ERROR "'${ARGN}' failed: ${status}")
+  endif()
+endfunction()
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}/output")
+
+execute_process(
+  COMMAND "${CPP2C}" -classes=Semaphore -emit-cmake
+          "${SOURCE_DIR}/semaphore.cpp" --
+          -x c++ -std=c++11 "-I${SOURCE_DIR}/include"
+  WORKING_DIRECTORY "${WORK_DIR}/output"
+  RESULT_VARIABLE status)
+if(status)
+  message(FATAL_ERROR "cpp2c failed: ${status}")
+endif()
+
+run("${CMAKE_COMMAND}" -S "${SOURCE_DIR}" -B "${WORK_DIR}/build"
+    -DCMAKE_BUILD_TYPE=Release
+    -DCMAKE_C_COMPILER=clang -DCMAKE_CXX_COMPILER=clang++
+    "-DCPP2C_OUTPUT=${WORK_DIR}/output"
+    -DCWRAPPER_LINK_LIBRARIES=semaphore)
+run("${CMAKE_COMMAND}" --build "${WORK_DIR}/build" --target caller)
+
+find_program(OBJDUMP NAMES llvm-objdump objdump)
+if(NOT OBJDUMP)
+  message(FATAL_ERROR "neither llvm-objdump nor objdump was found")
+endif()
+execute_process(COMMAND "${OBJDUMP}" -d "${WORK_DIR}/build/caller"
+                OUTPUT_VARIABLE disassembly RESULT_VARIABLE status)
+if(status)
+  message(FATAL_ERROR "${OBJDUMP} failed: ${status}")
+endif()
+
+# a call or tail call to the wrapper
+if(disassembly MATCHES "[ \t](call|jmp|bl|b)[a-z]*[ \t]+[^\n]*<Semaphore_V[>+]")
+  message(FATAL_ERROR "caller still calls Semaphore_V")
+endif()
+message(STATUS "Semaphore_V is inlined into its C caller")
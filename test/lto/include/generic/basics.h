@@ -0,0 +1,13 @@
+// Stands for the uThreads headers that cwrapper.cpp includes
+#pragma once
+
+class Semaphore {
+public:
+  Semaphore();
+  ~Semaphore();
+  void V();
+  int value();
+
+private:
+  int count;
+};
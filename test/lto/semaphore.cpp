@@ -0,0 +1,9 @@
+#include "generic/basics.h"
+
+Semaphore::Semaphore() : count(0) {}
+
+Semaphore::~Semaphore() {}
+
+void Semaphore::V() { count++; }
+
+int Semaphore::value() { return count; }